@@ -0,0 +1,149 @@
+/*
+    cfa779-raw.c - runs a script of raw commands through /dev/cfa779N
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    usage: cfa779-raw [-d /dev/cfa779N] [script]
+
+    Every script line is one command: the code and up to 16 payload
+    bytes, all in hex, e.g. "06 64" for contrast 100. Empty lines and
+    lines starting with '#' are skipped. For every command one line
+    "code status reply..." is printed, the reply being the reply code,
+    data and crc in hex. Needs the driver loaded with rawcmd=1.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "cfa779.h"
+
+static const char *status_name[] = {
+    [CFA779_REPLY_OK] = "ok",
+    [CFA779_REPLY_NONE] = "none",
+    [CFA779_REPLY_BADCRC] = "badcrc",
+    [CFA779_REPLY_BADLEN] = "badlen",
+    [CFA779_REPLY_ERROR] = "error",
+};
+
+static struct cfa779_raw cmds[CFA779_RAW_BATCH_MAX];
+
+/* returns the number of commands that failed */
+static int
+run (int fd, int count)
+{
+    struct cfa779_raw_batch batch;
+    int i, j, failed = 0;
+
+    memset (&batch, 0, sizeof (batch));
+    batch.cmds = (unsigned long) cmds;
+    batch.count = count;
+    if (ioctl (fd, CFA779_IOC_RAW, &batch) < 0)
+      {
+          perror ("CFA779_IOC_RAW");
+          if (batch.done < (unsigned) count)
+              failed += count - batch.done;
+      }
+
+    for (i = 0; i < (int) batch.done; i++)
+      {
+          printf ("%02x %s", cmds[i].code,
+                  cmds[i].status < 5 ? status_name[cmds[i].status] : "?");
+          for (j = 0; j < cmds[i].reply_len; j++)
+              printf (" %02x", cmds[i].reply[j]);
+          printf ("\n");
+          if (cmds[i].status != CFA779_REPLY_OK)
+              failed++;
+      }
+    return failed;
+}
+
+static int
+parse (const char *line, struct cfa779_raw *cmd)
+{
+    const char *p = line;
+    char *end;
+    unsigned long v;
+    int n = 0;
+
+    memset (cmd, 0, sizeof (*cmd));
+    for (;;)
+      {
+          v = strtoul (p, &end, 16);
+          if (end == p)
+              break;
+          if (v > 0xff || n > CFA779_MAX_PAYLOAD)
+              return -1;
+          if (n == 0)
+              cmd->code = v;
+          else
+              cmd->data[n - 1] = v;
+          n++;
+          p = end;
+      }
+    while (*p == ' ' || *p == '\t' || *p == '\n')
+        p++;
+    if (*p || n == 0)
+        return -1;
+    cmd->len = n - 1;
+    return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *dev = "/dev/cfa7790";
+    FILE *in = stdin;
+    char line[256];
+    int fd, opt, count = 0, lineno = 0, failed = 0;
+
+    while ((opt = getopt (argc, argv, "d:")) != -1)
+        switch (opt)
+          {
+          case 'd':
+              dev = optarg;
+              break;
+          default:
+              fprintf (stderr, "usage: %s [-d device] [script]\n", argv[0]);
+              return 2;
+          }
+    if (optind < argc && !(in = fopen (argv[optind], "r")))
+      {
+          perror (argv[optind]);
+          return 2;
+      }
+    if ((fd = open (dev, O_RDWR)) < 0)
+      {
+          perror (dev);
+          return 2;
+      }
+
+    while (fgets (line, sizeof (line), in))
+      {
+          lineno++;
+          if (line[strspn (line, " \t\n")] == 0 || line[0] == '#')
+              continue;
+          if (parse (line, &cmds[count]) < 0)
+            {
+                fprintf (stderr, "line %d: bad command\n", lineno);
+                return 2;
+            }
+          if (++count == CFA779_RAW_BATCH_MAX)
+            {
+                failed += run (fd, count);
+                count = 0;
+            }
+      }
+    if (count)
+        failed += run (fd, count);
+
+    close (fd);
+    return failed ? 1 : 0;
+}
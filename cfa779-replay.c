@@ -0,0 +1,309 @@
+/*
+    cfa779-replay.c - sends a captured bus trace to a CFA-779 again
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    usage: cfa779-replay [-b bus] [-a addr] [-s speed] [-v] capture
+
+    capture is a copy of debugfs cfa779/<device>/capture. Every packet in
+    it is sent again through /dev/i2c-<bus>, at the time it was sent
+    originally divided by speed (0: back to back), and if the driver read
+    a reply to it, the reply is read and its verdict compared with the
+    captured one. Packets are sent byte for byte as captured, broken ones
+    included, replies are read as SMBus block reads.
+
+    Meant for cfa779_emu loaded with detect=0, so cfa779.ko does not
+    share the bus. There the key state of every captured keypad reply is
+    fed to the emulator's keypad file before the poll that read it, so
+    polls see the same key presses as the captured ones did.
+
+    Prints one "name value" pair per line like cfa779-bench, with -v
+    also every reply whose verdict differs from the captured one.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+#include "cfa779.h"
+
+#define NUM_KEYS 5
+
+/* emulator key names by hardware key number - 1 */
+static const char *key_name[NUM_KEYS] = {
+    "left", "right", "up", "down", "enter"
+};
+
+static struct cfa779_capture *recs;
+static int nrecs;
+static int verbose;
+
+static unsigned short
+calc_crc (const unsigned char *p, int len)
+{
+    unsigned short crc = 0xFFFF;
+    int i;
+
+    while (len--)
+      {
+          crc ^= *p++;
+          for (i = 0; i < 8; i++)
+              crc = crc & 1 ? (crc >> 1) ^ 0x8408 : crc >> 1;
+      }
+    return ~crc;
+}
+
+static double
+now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+wait_until (double t)
+{
+    struct timespec ts;
+    double d = t - now ();
+
+    if (d <= 0)
+        return;
+    ts.tv_sec = d;
+    ts.tv_nsec = (d - ts.tv_sec) * 1e9;
+    nanosleep (&ts, NULL);
+}
+
+static int
+smbus (int fd, char rw, unsigned char cmd, union i2c_smbus_data *d)
+{
+    struct i2c_smbus_ioctl_data args;
+
+    args.read_write = rw;
+    args.command = cmd;
+    args.size = I2C_SMBUS_BLOCK_DATA;
+    args.data = d;
+    return ioctl (fd, I2C_SMBUS, &args);
+}
+
+/* the driver's verdict on a reply block, b[0] being its length */
+static int
+verdict (unsigned char code, const unsigned char *b)
+{
+    unsigned short crc;
+    int i = b[0];
+
+    if (i < 3)
+        return CFA779_REPLY_NONE;
+    crc = calc_crc (b, i - 1);
+    if (b[i - 1] != (crc & 0xFF) || b[i] != ((crc >> 8) & 0xFF))
+        return CFA779_REPLY_BADCRC;
+    if ((b[1] & 0xBF) != code)
+        return CFA779_REPLY_ERROR;
+    return CFA779_REPLY_OK;
+}
+
+static void
+key_cmd (int fd, const char *action, int key)
+{
+    char buf[32];
+    int n;
+
+    n = snprintf (buf, sizeof (buf), "%s %s", action, key_name[key]);
+    if (write (fd, buf, n) != n)
+        perror ("keypad");
+}
+
+/* makes the emulator's next keypad reply match the captured one: reply
+data is the held keys, then the press and the release edges */
+static void
+feed_keys (int fd, const struct cfa779_capture *reply, unsigned char *held)
+{
+    const unsigned char *d = &reply->data[1];
+    int i, bit;
+
+    for (i = 0; i < NUM_KEYS; i++)
+      {
+          bit = 1 << i;
+          if (d[1 + i] && d[1 + NUM_KEYS + i])
+            {
+                key_cmd (fd, "tap", i);
+                if ((d[0] & bit) && !(*held & bit))
+                    key_cmd (fd, "press", i);
+                else if (!(d[0] & bit) && (*held & bit))
+                    key_cmd (fd, "release", i);
+            }
+          else if (d[1 + i])
+              key_cmd (fd, "press", i);
+          else if (d[1 + NUM_KEYS + i])
+              key_cmd (fd, "release", i);
+      }
+    *held = d[0];
+}
+
+static int
+load (const char *path)
+{
+    FILE *f = fopen (path, "r");
+    long size;
+
+    if (!f)
+      {
+          perror (path);
+          return -1;
+      }
+    fseek (f, 0, SEEK_END);
+    size = ftell (f);
+    rewind (f);
+    if (size % sizeof (*recs))
+        fprintf (stderr, "%s: trailing partial record ignored\n", path);
+    nrecs = size / sizeof (*recs);
+    if (nrecs == 0)
+      {
+          fprintf (stderr, "%s: empty capture\n", path);
+          fclose (f);
+          return -1;
+      }
+    recs = malloc (nrecs * sizeof (*recs));
+    if (!recs || fread (recs, sizeof (*recs), nrecs, f) != (size_t) nrecs)
+      {
+          fprintf (stderr, "%s: read failed\n", path);
+          fclose (f);
+          return -1;
+      }
+    fclose (f);
+    return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+    union i2c_smbus_data d;
+    char path[64];
+    int bus = 0, addr = 0x20, fd, keyfd, opt, i, got;
+    int packets = 0, replies = 0, mismatch = 0, skipped = 0;
+    unsigned char held = 0;
+    double speed = 1, start, elapsed, span;
+    const struct cfa779_capture *r;
+
+    while ((opt = getopt (argc, argv, "b:a:s:v")) != -1)
+        switch (opt)
+          {
+          case 'b':
+              bus = atoi (optarg);
+              break;
+          case 'a':
+              addr = strtol (optarg, NULL, 0);
+              break;
+          case 's':
+              speed = atof (optarg);
+              break;
+          case 'v':
+              verbose = 1;
+              break;
+          default:
+              fprintf (stderr, "usage: %s [-b bus] [-a addr] [-s speed] "
+                       "[-v] capture\n", argv[0]);
+              return 2;
+          }
+    if (optind != argc - 1)
+      {
+          fprintf (stderr, "usage: %s [-b bus] [-a addr] [-s speed] "
+                   "[-v] capture\n", argv[0]);
+          return 2;
+      }
+    if (load (argv[optind]) < 0)
+        return 2;
+
+    snprintf (path, sizeof (path), "/dev/i2c-%d", bus);
+    if ((fd = open (path, O_RDWR)) < 0)
+      {
+          perror (path);
+          return 2;
+      }
+    if (ioctl (fd, I2C_SLAVE, addr) < 0)
+      {
+          fprintf (stderr, "%s: address 0x%02x: %s (cfa779.ko bound? load "
+                   "cfa779_emu with detect=0)\n", path, addr,
+                   strerror (errno));
+          return 2;
+      }
+    snprintf (path, sizeof (path),
+              "/sys/kernel/debug/cfa779-emu/i2c-%d/keypad", bus);
+    keyfd = open (path, O_WRONLY);
+
+    start = now ();
+    for (i = 0; i < nrecs; i++)
+      {
+          r = &recs[i];
+          if (r->dir != CFA779_CAP_SEND)
+              continue;
+          if (r->len < 4 || r->len > sizeof (r->data))
+            {
+                skipped++;
+                continue;
+            }
+          if (speed > 0)
+              wait_until (start + (r->ns - recs[0].ns) / 1e9 / speed);
+
+          if (r->code == 9 && keyfd >= 0 && i + 1 < nrecs
+              && recs[i + 1].dir == CFA779_CAP_REPLY
+              && recs[i + 1].status == CFA779_REPLY_OK
+              && recs[i + 1].len >= 3 + 1 + 2 * NUM_KEYS)
+              feed_keys (keyfd, &recs[i + 1], &held);
+
+          d.block[0] = r->len - 2;
+          memcpy (&d.block[1], &r->data[2], r->len - 2);
+          if (smbus (fd, I2C_SMBUS_WRITE, r->data[0], &d) < 0 && verbose)
+              printf ("record %d: code %u not sent: %s\n", i, r->code,
+                      strerror (errno));
+          packets++;
+
+          if (i + 1 >= nrecs || recs[i + 1].dir != CFA779_CAP_REPLY
+              || recs[i + 1].code != r->code)
+              continue;
+          i++;
+          if (smbus (fd, I2C_SMBUS_READ, r->code, &d) < 0)
+              d.block[0] = 0;
+          replies++;
+          got = verdict (r->code, d.block);
+          /* the driver checks the length only while detecting */
+          if (got != recs[i].status
+              && !(recs[i].status == CFA779_REPLY_BADLEN
+                   && got == CFA779_REPLY_OK))
+            {
+                mismatch++;
+                if (verbose)
+                    printf ("record %d: code %u verdict %u, captured %u\n",
+                            i, r->code, got, recs[i].status);
+            }
+      }
+    elapsed = now () - start;
+    span = (recs[nrecs - 1].ns - recs[0].ns) / 1e9;
+
+    printf ("records %d\n", nrecs);
+    printf ("packets %d\n", packets);
+    printf ("skipped %d\n", skipped);
+    printf ("replies %d\n", replies);
+    printf ("verdict_mismatch %d\n", mismatch);
+    printf ("capture_seconds %.3f\n", span);
+    printf ("replay_seconds %.3f\n", elapsed);
+    printf ("replay_packets_per_sec %.1f\n",
+            elapsed > 0 ? packets / elapsed : 0);
+
+    if (keyfd >= 0)
+        close (keyfd);
+    close (fd);
+    return mismatch ? 1 : 0;
+}
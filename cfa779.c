@@ -25,13 +25,39 @@
 #include <linux/init.h>
 #include <linux/slab.h>
 #include <linux/i2c.h>
+#include <linux/mutex.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/miscdevice.h>
+#include <linux/workqueue.h>
+#include <linux/idr.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/completion.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/wait.h>
+#include <linux/seqlock.h>
+#include <linux/random.h>
+#include <linux/delay.h>
+#include <linux/sched.h>
+#include <linux/capability.h>
+#include <linux/log2.h>
+#include <linux/kref.h>
+#include <linux/rwsem.h>
+#include <linux/math64.h>
+
+#include <asm/uaccess.h>
 
 #include <linux/io.h>
 #include <linux/input.h>
-#include <linux/input-polldev.h>
 
 #include <linux/crc-ccitt.h>
 
+#include "cfa779.h"
+
 #define CFA779_INIT 255         /* Default value for stored params */
 #define CFA779_MAX_CONTRAST 200 /* max contrast value */
 #define CFA779_MAX_BACKLIGHT 100        /* max backlight value */
@@ -39,18 +65,126 @@
 #define CFA779_NUM_COLUMNS  16  /* LCD columns */
 #define CFA779_NUM_ROWS     2   /* LCD rows */
 #define CFA779_NUM_KEYS     5   /* keypad keys */
-
-#define POLL_INTERVAL_DEFAULT   100
+#define CFA779_NUM_KEYCODES (2 * CFA779_NUM_KEYS)       /* ... and long presses */
+#define CFA779_FRAME_SIZE   (CFA779_NUM_ROWS * CFA779_NUM_COLUMNS)
+#define CFA779_NUM_GLYPHS   8   /* user defined characters */
+#define CFA779_GLYPH_WIDTH  5   /* pixels per character cell */
+#define CFA779_MARQUEE_MAX  128 /* marquee text, including the gap */
+#define CFA779_MARQUEE_GAP  4   /* blanks between the end and the start */
+#define CFA779_NUM_CODES    10  /* command codes 0..9 */
+#define CFA779_REPLY_SIZE   256 /* reply buffer size */
+#define CFA779_LAT_BUCKETS  16  /* log2 latency histogram, up to 32ms+ */
+#define CFA779_KEYPAD_SIZE  11  /* data bytes of a code 9 reply */
+#define CFA779_EDGE_RING    32  /* key edges remembered for sysfs */
+#define CFA779_VERSION_LEN  32
+#define CFA779_ACK_BATCH    8   /* deferred mode checks one ack per batch */
+#define CFA779_RETRY_MASK   0x1FF       /* all but 9, which clears key edges */
+#define CFA779_BACKOFF_MIN  2   /* ms before the first retry */
+#define CFA779_BACKOFF_MAX  64
+#define CFA779_DEGRADE_AFTER 3  /* failed exchanges in a row */
+
+/* How posted writes are acknowledged */
+#define CFA779_ACK_NONE     0   /* not at all */
+#define CFA779_ACK_VERIFIED 1   /* each reply is read before the next write */
+#define CFA779_ACK_DEFERRED 2   /* writes go back to back, acks in batches */
+
+/* commands whose queued writes are replaced by a newer write of the same
+command instead of being sent twice: lines, cursor, contrast, backlight */
+#define CFA779_COALESCE_MASK ((1 << 1) | (1 << 2) | (1 << 4) | (1 << 5) | \
+                              (1 << 6) | (1 << 7))
+
+#define POLL_INTERVAL_DEFAULT   200     /* idle keypad poll interval */
+#define POLL_INTERVAL_FAST      20      /* poll interval after a key event */
+#define POLL_DECAY_DEFAULT      3000    /* time spent polling fast */
+#define POLL_INTERVAL_MIN       10
+#define POLL_INTERVAL_DEGRADED  2000    /* while the bus keeps failing */
+#define POLL_BUDGET_DEFAULT     20      /* ms a due poll may be delayed */
+#define POLL_INTERVAL_IDLE      1000    /* keep-alive while the panel is idle */
+#define CFA779_CAPTURE_MAX      (1 << 20)       /* capture records */
+
+#define CREATE_TRACE_POINTS
+#include "cfa779_trace.h"
 
 /* insmod options */
 static unsigned int debug = 0;
 static unsigned int rawcmd = 0;
-
-
-module_param (debug, int, 0);
+static unsigned int max_fps = 25;
+static unsigned int force_smbus = 0;
+static unsigned int poll_interval = POLL_INTERVAL_DEFAULT;
+static unsigned int poll_min = POLL_INTERVAL_FAST;
+static unsigned int poll_decay = POLL_DECAY_DEFAULT;
+static unsigned int poll_degraded = POLL_INTERVAL_DEGRADED;
+static unsigned int retries = 3;
+static unsigned int display_bps = 0;
+static unsigned int poll_budget = POLL_BUDGET_DEFAULT;
+static unsigned int marquee_speed = 300;
+static unsigned int marquee_pause = 3000;
+static unsigned int repeat_delay = 0;
+static unsigned int repeat_period = 0;
+static unsigned int long_press = 0;
+static unsigned int idle_timeout = 0;
+static unsigned int idle_backlight = 0;
+static unsigned int poll_idle = POLL_INTERVAL_IDLE;
+static unsigned int capture = 0;
+static unsigned int key_resync = 0;
+
+module_param (debug, int, 0644);
 MODULE_PARM_DESC (debug, "enable debug messages");
 module_param (rawcmd, int, 0);
 MODULE_PARM_DESC (rawcmd, "enable rawcmd interface");
+module_param (max_fps, uint, 0644);
+MODULE_PARM_DESC (max_fps, "max frames per second flushed from /dev/cfa779N "
+                  "(0 = no limit)");
+module_param (force_smbus, uint, 0);
+MODULE_PARM_DESC (force_smbus, "use SMBus block transfers even if the adapter "
+                  "can do combined I2C transfers");
+module_param (poll_interval, uint, 0644);
+MODULE_PARM_DESC (poll_interval, "idle keypad poll interval in ms, polling "
+                  "only runs while the input device is open");
+module_param (poll_min, uint, 0644);
+MODULE_PARM_DESC (poll_min, "keypad poll interval in ms while keys are in use");
+module_param (poll_decay, uint, 0644);
+MODULE_PARM_DESC (poll_decay, "ms after the last key event before the poll "
+                  "interval starts doubling back to poll_interval");
+module_param (poll_degraded, uint, 0644);
+MODULE_PARM_DESC (poll_degraded, "keypad poll interval in ms while the bus "
+                  "keeps failing");
+module_param (retries, uint, 0644);
+MODULE_PARM_DESC (retries, "times a failed exchange is retried");
+module_param (display_bps, uint, 0644);
+MODULE_PARM_DESC (display_bps, "bus bytes per second display updates may use "
+                  "(0 = no limit)");
+module_param (poll_budget, uint, 0644);
+MODULE_PARM_DESC (poll_budget, "ms a keypad poll may start late before it "
+                  "counts as an overrun");
+module_param (marquee_speed, uint, 0644);
+MODULE_PARM_DESC (marquee_speed, "ms per column a marquee scrolls");
+module_param (marquee_pause, uint, 0644);
+MODULE_PARM_DESC (marquee_pause, "ms marquees stand still after a key event");
+module_param (repeat_delay, uint, 0444);
+MODULE_PARM_DESC (repeat_delay, "ms a key is held before it repeats "
+                  "(0 = input layer default)");
+module_param (repeat_period, uint, 0444);
+MODULE_PARM_DESC (repeat_period, "ms between key repeats "
+                  "(0 = input layer default)");
+module_param (long_press, uint, 0644);
+MODULE_PARM_DESC (long_press, "ms a key is held before its long press code "
+                  "is sent (0 = never)");
+module_param (idle_timeout, uint, 0644);
+MODULE_PARM_DESC (idle_timeout, "seconds without key presses or display "
+                  "changes before the panel dims (0 = never)");
+module_param (idle_backlight, uint, 0644);
+MODULE_PARM_DESC (idle_backlight, "backlight while the panel is idle");
+module_param (poll_idle, uint, 0644);
+MODULE_PARM_DESC (poll_idle, "keypad poll interval in ms while the panel is "
+                  "idle");
+module_param (capture, uint, 0444);
+MODULE_PARM_DESC (capture, "packets and replies kept in debugfs capture, "
+                  "rounded up to a power of two (0 = off)");
+module_param (key_resync, uint, 0644);
+MODULE_PARM_DESC (key_resync, "report edges lost with a keypad reply from "
+                  "the held keys in the next one; needs byte 1 of the reply "
+                  "to be the held key mask, as cfa779_emu sends it");
 
 MODULE_AUTHOR ("Max <max@hexview.com>");
 MODULE_DESCRIPTION ("CrystalFontz CFA779 LCD Driver");
@@ -60,6 +194,9 @@ static const unsigned short normal_i2c[] = { 0x20, I2C_CLIENT_END };
 
 I2C_CLIENT_INSMOD_1 (cfa779);
 
+#define cfa779_dbg(dev, format, arg...) \
+    do { if (debug) dev_info (dev, format, ## arg); } while (0)
+
 /* ---------------------------------------------------------------------*/
 
 s32
@@ -78,21 +215,153 @@ i2c_smbus_read_block_data (struct i2c_client *client, u8 command, u8 * values)
       }
 }
 
+/* A command waiting for the bus */
+struct cfa779_cmd
+{
+    struct list_head list;
+    u8 code;
+    u8 len;
+    u8 payload[CFA779_MAX_PAYLOAD];
+    u8 *reply;                  /* NULL for posted writes */
+    int result;                 /* lcd_check_reply() result */
+    u8 status;                  /* ... and its CFA779_REPLY_* verdict */
+    struct completion *done;    /* NULL for posted writes */
+};
+
+/* Bus statistics, only updated from the bus workqueue */
+struct cfa779_stats
+{
+    unsigned long sent[CFA779_NUM_CODES + 1];   /* Last one: other codes */
+    unsigned long replies;      /* Replies that passed the CRC check */
+    unsigned long no_reply;
+    unsigned long bad_crc;
+    unsigned long bad_len;
+    unsigned long error_reply;  /* Device flagged the command as failed */
+    unsigned long latency[CFA779_LAT_BUCKETS];  /* Exchanges by fls(us) */
+    unsigned long polls;
+    unsigned long poll_events;  /* Polls that reported key edges */
+    unsigned long key_resyncs;  /* Edges missed, found in the key state */
+    unsigned long acks;         /* Write replies checked */
+    unsigned long ack_failed;   /* ... which were missing or wrong */
+    unsigned long retries;
+    unsigned long failed;       /* Exchanges failed after all retries */
+    unsigned long degraded;     /* Times the bus was declared unhealthy */
+    unsigned long resyncs;
+    unsigned long dropped;      /* Queued writes replaced by newer ones */
+    unsigned long throttled;    /* Times display writes had to wait */
+    unsigned long poll_overruns;        /* Polls later than poll_budget */
+    u32 poll_late_max_us;
+};
+
+/* A key edge as seen by the poller */
+struct cfa779_edge
+{
+    s64 us;                     /* ktime_get() of the poll, in us */
+    unsigned short keycode;
+    u8 value;                   /* 1 pressed, 0 released */
+};
+
 /* Each client has this additional data */
 struct cfa779_data
 {
     struct i2c_client *client;
-    struct input_polled_dev *ipdev;
-    unsigned short keymap[CFA779_NUM_KEYS];
-    u16 nkeys;
+    struct input_dev *idev;
+    struct delayed_work poll_work;
+    ktime_t poll_due;           /* When poll_work should run */
+    unsigned int cur_interval;  /* Current keypad poll interval, ms */
+    unsigned long active_until; /* jiffies until which to poll fast */
+    u8 keys_down;               /* Bitmask of keys pressed, not released */
+    ktime_t last_poll;          /* When the previous poll was sent */
+    unsigned long key_events;   /* Press/release edges seen */
+    u64 key_latency_us;         /* Sum of their worst case latency */
+    u32 key_latency_max_us;
+    struct work_struct keypad_work;     /* One-shot poll for sysfs */
+    seqlock_t keypad_lock;      /* Protects the keypad snapshot below */
+    u8 keypad[CFA779_KEYPAD_SIZE];      /* Last code 9 reply */
+    bool keypad_valid;
+    unsigned long keypad_stamp; /* jiffies when it was read */
+    struct cfa779_edge edges[CFA779_EDGE_RING];
+    unsigned long nedges;       /* Edges ever recorded */
+    unsigned short keymap[CFA779_NUM_KEYCODES];
+    unsigned long key_down_at[CFA779_NUM_KEYS]; /* jiffies of the press */
+    u8 long_sent;               /* Keys whose long press was reported */
+    char phys[32];
     u8 backlight;               /* Stores last written value */
     u8 contrast;                /* Stores last written value */
     u8 cursor;                  /* Stores last written value */
+    char version[CFA779_VERSION_LEN];   /* Read by init_work */
+    struct work_struct init_work;       /* Reset, version and splash */
+    u32 probe_us;               /* Time spent in cfa779_probe() */
+    u32 init_us;                /* Time spent in init_work */
+    struct mutex update_lock;   /* Protects the shadow state below */
+    char shadow[CFA779_NUM_ROWS][CFA779_NUM_COLUMNS];   /* Text on the glass */
+    u8 shadow_valid;            /* Bitmask of rows whose shadow is known */
+    u8 cursor_row;              /* Stores last written value */
+    u8 cursor_col;              /* Stores last written value */
+    unsigned long elided;       /* Writes skipped as already displayed */
+    u8 cgram[CFA779_NUM_GLYPHS][8];     /* User character bitmaps */
+    u8 cgram_valid;             /* Bitmask of glyphs known to be loaded */
+    unsigned long cgram_used[CFA779_NUM_GLYPHS];        /* LRU stamps */
+    unsigned long cgram_clock;
+    char marquee[CFA779_NUM_ROWS][CFA779_MARQUEE_MAX];  /* Scrolling text */
+    u8 marquee_len[CFA779_NUM_ROWS];
+    u8 marquee_pos[CFA779_NUM_ROWS];    /* Column shown leftmost */
+    u8 marquee_active;          /* Bitmask of scrolling rows */
+    unsigned long marquee_resume;       /* jiffies, paused by keys until */
+    struct delayed_work marquee_work;
+    unsigned long last_activity;        /* jiffies of the last key press or
+                                           display change */
+    bool idle;                  /* Dimmed, polling slowly */
+    struct delayed_work idle_work;
+    int id;                     /* N in /dev/cfa779N */
+    char devname[16];
+    struct miscdevice miscdev;
+    struct list_head node;      /* In cfa779_devices */
+    struct kref kref;           /* Held by the client and open files */
+    struct rw_semaphore gone_sem;       /* Protects gone */
+    bool gone;                  /* Client removed, files are orphaned */
+    char *frame;                /* Page shared with /dev/cfa779N users */
+    struct delayed_work flush_work;
+    unsigned long last_flush;   /* jiffies of the last frame flush */
+    struct workqueue_struct *wq;        /* The only thread using the bus */
+    char wqname[24];
+    struct work_struct cmd_work;
+    struct delayed_work throttle_work;  /* Restarts cmd_work for writes
+                                           held back by display_bps */
+    long tokens;                /* Bytes display writes may send now */
+    unsigned long token_stamp;  /* jiffies tokens were last added */
+    bool draining;              /* Removing, send without a budget */
+    bool suspended;             /* Hold queued commands until resume */
+    bool flush_pending;         /* Suspend cancelled a frame flush */
+    unsigned int queued;        /* Commands in cmd_queue */
+    unsigned int queue_max;
+    spinlock_t cmd_lock;        /* Protects cmd_queue and pending */
+    struct list_head cmd_queue;
+    struct cfa779_cmd *pending[CFA779_NUM_CODES];       /* Coalescible */
+    unsigned int failures;      /* Failed exchanges in a row */
+    bool degraded;              /* Bus unhealthy, poll slowly, don't retry */
+    u8 ack_mode;
+    u8 ack_code;                /* Last write of the unchecked batch */
+    u16 ack_mask;               /* Codes written in it */
+    int ack_count;
+    bool use_i2c;               /* Combined write+read with repeated start */
+    u8 last_status;             /* Verdict on the last reply */
+    unsigned long xfer_count;   /* Request/reply exchanges done */
+    u64 xfer_time_us;           /* Total time spent in them */
+    u32 xfer_max_us;            /* Slowest one */
+    struct cfa779_stats stats;
+    spinlock_t capture_lock;    /* Protects the capture ring */
+    struct cfa779_capture *capture_ring;        /* Last packets and replies */
+    unsigned int capture_size;  /* Records in it, a power of two */
+    unsigned int capture_head;  /* Records ever written */
+    struct dentry *debugfs;
 };
 
 static int cfa779_probe (struct i2c_client *client,
                          const struct i2c_device_id *id);
 static int cfa779_remove (struct i2c_client *client);
+static int cfa779_suspend (struct i2c_client *client, pm_message_t mesg);
+static int cfa779_resume (struct i2c_client *client);
 static int cfa779_detect (struct i2c_client *client, int kind,
                           struct i2c_board_info *board_info);
 
@@ -113,14 +382,16 @@ static struct i2c_driver cfa779_driver = {
     .id_table = cfa779_idtable,
     .probe = cfa779_probe,
     .remove = cfa779_remove,
+    .suspend = cfa779_suspend,
+    .resume = cfa779_resume,
 
     .address_data = &addr_data,
     .detect = cfa779_detect
 };
 
 
-static void lcd_send_packet (struct i2c_client *client, u8 code, int len,
-                             char *data);
+static int lcd_send_packet (struct i2c_client *client, u8 code, int len,
+                            char *data);
 static int lcd_check_reply (struct i2c_client *client, u8 code, int len,
                             char *buf);
 
@@ -128,6 +399,9 @@ static ssize_t cfa779_show_version (struct device *dev,
                                     struct device_attribute *attr, char *buf);
 static ssize_t cfa779_show_keypad (struct device *dev,
                                    struct device_attribute *attr, char *buf);
+static ssize_t cfa779_show_keypad_events (struct device *dev,
+                                          struct device_attribute *attr,
+                                          char *buf);
 static ssize_t cfa779_show_contrast (struct device *dev,
                                      struct device_attribute *attr,
                                      char *buf);
@@ -137,6 +411,16 @@ static ssize_t cfa779_show_backlight (struct device *dev,
 static ssize_t cfa779_show_cursor_style (struct device *dev,
                                          struct device_attribute *attr,
                                          char *buf);
+static ssize_t cfa779_show_elided (struct device *dev,
+                                   struct device_attribute *attr, char *buf);
+static ssize_t cfa779_show_transport (struct device *dev,
+                                      struct device_attribute *attr,
+                                      char *buf);
+static ssize_t cfa779_show_latency (struct device *dev,
+                                    struct device_attribute *attr, char *buf);
+static ssize_t cfa779_show_key_latency (struct device *dev,
+                                        struct device_attribute *attr,
+                                        char *buf);
 
 static ssize_t cfa779_set_contrast (struct device *dev,
                                     struct device_attribute *attr,
@@ -153,15 +437,37 @@ static ssize_t cfa779_set_line1 (struct device *dev,
 static ssize_t cfa779_set_line2 (struct device *dev,
                                  struct device_attribute *attr,
                                  const char *buf, size_t count);
+static ssize_t cfa779_set_marquee1 (struct device *dev,
+                                    struct device_attribute *attr,
+                                    const char *buf, size_t count);
+static ssize_t cfa779_set_marquee2 (struct device *dev,
+                                    struct device_attribute *attr,
+                                    const char *buf, size_t count);
 static ssize_t cfa779_set_character (struct device *dev,
                                      struct device_attribute *attr,
                                      const char *buf, size_t count);
+static ssize_t cfa779_set_bargraph (struct device *dev,
+                                    struct device_attribute *attr,
+                                    const char *buf, size_t count);
 static ssize_t cfa779_set_cursor_pos (struct device *dev,
                                       struct device_attribute *attr,
                                       const char *buf, size_t count);
 static ssize_t cfa779_set_rawcmd (struct device *dev,
                                   struct device_attribute *attr,
                                   const char *buf, size_t count);
+static ssize_t cfa779_set_refresh_version (struct device *dev,
+                                           struct device_attribute *attr,
+                                           const char *buf, size_t count);
+static ssize_t cfa779_show_queue (struct device *dev,
+                                  struct device_attribute *attr, char *buf);
+static ssize_t cfa779_show_ack_mode (struct device *dev,
+                                     struct device_attribute *attr,
+                                     char *buf);
+static ssize_t cfa779_set_ack_mode (struct device *dev,
+                                    struct device_attribute *attr,
+                                    const char *buf, size_t count);
+
+static struct dentry *cfa779_debugfs_root;
 
 static u16
 calc_crc (u8 * data, int len)
@@ -179,77 +485,834 @@ static DEVICE_ATTR (cursor_style, S_IWUSR | S_IRUGO, cfa779_show_cursor_style,
                     cfa779_set_cursor_style);
 static DEVICE_ATTR (line1, S_IWUSR, NULL, cfa779_set_line1);
 static DEVICE_ATTR (line2, S_IWUSR, NULL, cfa779_set_line2);
+static DEVICE_ATTR (marquee1, S_IWUSR, NULL, cfa779_set_marquee1);
+static DEVICE_ATTR (marquee2, S_IWUSR, NULL, cfa779_set_marquee2);
 static DEVICE_ATTR (user_character, S_IWUSR, NULL, cfa779_set_character);
+static DEVICE_ATTR (bargraph, S_IWUSR, NULL, cfa779_set_bargraph);
 static DEVICE_ATTR (keypad, S_IRUGO, cfa779_show_keypad, NULL);
+static DEVICE_ATTR (keypad_events, S_IRUGO, cfa779_show_keypad_events, NULL);
 static DEVICE_ATTR (cursor_position, S_IWUSR, NULL, cfa779_set_cursor_pos);
 static DEVICE_ATTR (rawcmd, S_IWUSR, NULL, cfa779_set_rawcmd);
+static DEVICE_ATTR (elided, S_IRUGO, cfa779_show_elided, NULL);
+static DEVICE_ATTR (transport, S_IRUGO, cfa779_show_transport, NULL);
+static DEVICE_ATTR (latency, S_IRUGO, cfa779_show_latency, NULL);
+static DEVICE_ATTR (key_latency, S_IRUGO, cfa779_show_key_latency, NULL);
+static DEVICE_ATTR (refresh_version, S_IWUSR, NULL,
+                    cfa779_set_refresh_version);
+static DEVICE_ATTR (ack_mode, S_IWUSR | S_IRUGO, cfa779_show_ack_mode,
+                    cfa779_set_ack_mode);
+static DEVICE_ATTR (queue, S_IRUGO, cfa779_show_queue, NULL);
+
+static ssize_t cfa779_write_screen (struct kobject *kobj,
+                                    struct bin_attribute *attr, char *buf,
+                                    loff_t off, size_t count);
+
+static struct bin_attribute bin_attr_screen = {
+    .attr = {.name = "screen", .mode = S_IWUSR},
+    .size = CFA779_FRAME_SIZE + 3,
+    .write = cfa779_write_screen,
+};
 
-/* receives reply, checks crc, optionally copies reply to buffer
-returns reply length or 0 if error */
+/* fills val with the packet as it goes on the wire: code, byte count,
+payload, crc; returns the byte count */
 static int
-lcd_check_reply (struct i2c_client *client, u8 code, int len, char *buf)
+lcd_build_packet (u8 * val, u8 idx, int len, const char *data)
 {
-    u8 tb[256];
-    int i;
+    u16 crc;
+    if (len > CFA779_MAX_PAYLOAD)
+        len = CFA779_MAX_PAYLOAD;
+
+    val[0] = idx;
+    memcpy (&val[2], data, len++);
+    val[1] = ++len;
+
+    crc = calc_crc (val, len);
+
+    val[len] = crc & 0xFF;
+    val[len + 1] = (crc >> 8) & 0xFF;
+    return len;
+}
+
+/* appends a packet or a reply block to the capture ring, nothing to do
+while detecting or with capture off */
+static void
+cfa779_capture_add (struct i2c_client *client, u8 dir, u8 code, u8 status,
+                    const u8 * buf, int len)
+{
+    struct cfa779_data *data = i2c_get_clientdata (client);
+    struct cfa779_capture *rec;
+
+    if (!data || !data->capture_ring)
+        return;
+    spin_lock (&data->capture_lock);
+    rec = &data->capture_ring[data->capture_head++ &
+                              (data->capture_size - 1)];
+    memset (rec, 0, sizeof (*rec));
+    rec->ns = ktime_to_ns (ktime_get ());
+    rec->dir = dir;
+    rec->code = code;
+    rec->status = status;
+    rec->len = len;
+    memcpy (rec->data, buf, min_t (int, len, sizeof (rec->data)));
+    spin_unlock (&data->capture_lock);
+}
+
+/* accounts a reply verdict on the reply in tb, nothing to do while
+detecting */
+static void
+cfa779_count_reply (struct i2c_client *client, u8 code, const u8 * tb,
+                    int status)
+{
+    struct cfa779_data *data = i2c_get_clientdata (client);
+
+    trace_cfa779_reply (client, code, tb[0], status);
+    cfa779_capture_add (client, CFA779_CAP_REPLY, code, status, &tb[1],
+                        tb[0]);
+    if (!data)
+        return;
+    data->last_status = status;
+    switch (status)
+      {
+      case CFA779_REPLY_NONE:
+          data->stats.no_reply++;
+          break;
+      case CFA779_REPLY_BADCRC:
+          data->stats.bad_crc++;
+          break;
+      case CFA779_REPLY_BADLEN:
+          data->stats.replies++;
+          data->stats.bad_len++;
+          break;
+      case CFA779_REPLY_ERROR:
+          data->stats.replies++;
+          data->stats.error_reply++;
+          break;
+      default:
+          data->stats.replies++;
+      }
+}
+
+/* checks the reply in tb (tb[0] is the block length), optionally copies
+reply to buffer; returns reply length or 0 if error */
+static int
+lcd_verify_reply (struct i2c_client *client, u8 code, int len, u8 * tb,
+                  char *buf)
+{
+    int i = tb[0];
+    int status = CFA779_REPLY_OK;
     u16 crc;
 
-    i = i2c_smbus_read_block_data (client, code, &tb[1]);
-    tb[0] = i;
     if (buf != NULL)
         memcpy (buf, &tb[1], i);
     if (i < 3)
       {
-          printk
-              ("cfa779: No reply from LCD (cmd: 0x%02X, reply length: %d)\n",
-               code, i);
+          cfa779_count_reply (client, code, tb, CFA779_REPLY_NONE);
+          cfa779_dbg (&client->dev,
+                      "No reply from LCD (cmd: 0x%02X, reply length: %d)\n",
+                      code, i);
           return 0;
       }
     crc = calc_crc (tb, i - 1);
     if ((tb[i - 1] != (crc & 0xFF)) || (tb[i] != ((crc >> 8) & 0xFF)))
       {
-          printk ("cfa779: Received packet with invalid CRC (cmd: 0x%02X)\n",
-                  code);
+          cfa779_count_reply (client, code, tb, CFA779_REPLY_BADCRC);
+          cfa779_dbg (&client->dev,
+                      "Received packet with invalid CRC (cmd: 0x%02X)\n",
+                      code);
           return 0;
       }
     if ((len != -1) && ((len + 3) != i))
-        printk ("cfa779: Invalid packet length: %d, expected: %d\n", len + 3,
-                i);
+      {
+          status = CFA779_REPLY_BADLEN;
+          cfa779_dbg (&client->dev,
+                      "Invalid packet length: %d, expected: %d\n", len + 3,
+                      i);
+      }
     if ((tb[1] & 0xBF) != code)
-        printk ("cfa779: cmd 0x%02X failed with code (0x%02X)\n", code,
-                tb[1]);
+      {
+          status = CFA779_REPLY_ERROR;
+          cfa779_dbg (&client->dev, "cmd 0x%02X failed with code (0x%02X)\n",
+                      code, tb[1]);
+      }
+    cfa779_count_reply (client, code, tb, status);
     return i;
 }
 
-// code 8
-static void
-lcd_get_version (struct i2c_client *client, char *buf, int len)
+/* receives reply, checks crc, optionally copies reply to buffer
+returns reply length or 0 if error */
+static int
+lcd_check_reply (struct i2c_client *client, u8 code, int len, char *buf)
 {
     u8 tb[256];
+    int i;
+
+    i = i2c_smbus_read_block_data (client, code, &tb[1]);
+    tb[0] = i < 0 ? 0 : i;
+    return lcd_verify_reply (client, code, len, tb, buf);
+}
+
+/* sends a command and, if reply is not NULL, reads its reply back into
+it; returns reply length or 0 if error. On adapters that can do plain
+I2C the request and the reply go out as a single transfer with a
+repeated start in between, otherwise as SMBus block write + read.
+Without a reply buffer the packet is only sent; returns its length or 0
+if the adapter failed it.
+Only called from the bus workqueue. */
+static int
+cfa779_exchange (struct cfa779_data *data, u8 code, int len,
+                 const u8 * payload, u8 * reply)
+{
+    struct i2c_client *client = data->client;
+    u8 val[CFA779_MAX_PAYLOAD + 4];
+    u8 tb[I2C_SMBUS_BLOCK_MAX + 1];
+    struct i2c_msg msg[2];
+    ktime_t start;
+    u32 us;
+    int wire, ret;
+
+    data->stats.sent[min_t (u8, code, CFA779_NUM_CODES)]++;
+    if (!reply)
+      {
+          if (lcd_send_packet (client, code, len, (char *) payload) < 0)
+              return 0;
+          return len + 4;
+      }
+
+    start = ktime_get ();
+    if (data->use_i2c)
+      {
+          /* len stays the payload length for the SMBus fallback */
+          wire = lcd_build_packet (val, code, len, payload);
+          trace_cfa779_send (client, code, wire - 2, &val[2]);
+          cfa779_capture_add (client, CFA779_CAP_SEND, code, 0, val,
+                              wire + 2);
+          msg[0].addr = client->addr;
+          msg[0].flags = 0;
+          msg[0].len = wire + 2;
+          msg[0].buf = val;
+          msg[1].addr = client->addr;
+          msg[1].flags = I2C_M_RD | I2C_M_RECV_LEN;
+          msg[1].len = 1;
+          msg[1].buf = tb;
+          tb[0] = 0;
+          ret = i2c_transfer (client->adapter, msg, 2);
+          if (ret == -EOPNOTSUPP || ret == -EINVAL)
+            {
+                dev_warn (&client->dev, "combined transfer rejected (%d), "
+                          "falling back to SMBus\n", ret);
+                data->use_i2c = false;
+            }
+          else
+            {
+                if (ret != 2)
+                    tb[0] = 0;
+                ret = lcd_verify_reply (client, code, -1, tb, reply);
+            }
+      }
+    if (!data->use_i2c)
+      {
+          lcd_send_packet (client, code, len, (char *) payload);
+          ret = lcd_check_reply (client, code, -1, reply);
+      }
+
+    us = ktime_us_delta (ktime_get (), start);
+    trace_cfa779_xfer (client, code, ret, us);
+    data->stats.latency[min (fls (us), CFA779_LAT_BUCKETS - 1)]++;
+    data->xfer_count++;
+    data->xfer_time_us += us;
+    if (us > data->xfer_max_us)
+        data->xfer_max_us = us;
+    return ret;
+}
+
+/* ------------------------------------------------------------ */
+/* All bus traffic of a bound device goes through its command queue and
+is done by cmd_work, which runs on the device's single threaded
+workqueue, so a command and its reply can never be interleaved with
+another exchange. Writes are posted and return at once; callers which
+need the reply use cfa779_xfer() and sleep until it arrives.
+
+Keypad polls come first: cmd_work steps aside between commands whenever
+one is queued behind it, so a poll waits for one command and its retries
+at most. Everything else goes out in queue order. Posted display writes
+are limited to display_bps bytes per second, and only a synchronous
+command may pass a write held back that way; while it waits, newer
+writes of the same row or setting replace it in the queue. poll_budget
+is not enforced, polls starting later than that are only counted. */
+
+/* a keypad poll is waiting for the bus */
+static bool
+cfa779_poll_waiting (struct cfa779_data *data)
+{
+    return work_pending (&data->keypad_work)
+        || (delayed_work_pending (&data->poll_work)
+            && !timer_pending (&data->poll_work.timer));
+}
+
+/* token bucket holding up to 250ms worth of display_bps; returns false
+and the ms until cmd fits if it has to wait. Called with cmd_lock held. */
+static bool
+cfa779_budget_ok (struct cfa779_data *data, struct cfa779_cmd *cmd,
+                  unsigned int *wait)
+{
+    unsigned int bps = display_bps;
+    unsigned int ms = jiffies_to_msecs (jiffies - data->token_stamp);
+    long cost = cmd->len + 4;
+    long burst, add;
+
+    if (!bps || data->draining)
+        return true;
+
+    burst = max_t (long, bps / 4, CFA779_MAX_PAYLOAD + 4);
+    add = (long) min (ms, 1000U) * bps / 1000;
+    if (add)
+      {
+          data->tokens = min (burst, data->tokens + add);
+          data->token_stamp = jiffies;
+      }
+    if (data->tokens >= cost)
+      {
+          data->tokens -= cost;
+          return true;
+      }
+    *wait = (cost - data->tokens) * 1000 / bps + 1;
+    data->stats.throttled++;
+    return false;
+}
+
+/* takes the next command off the queue: the first one unless that is a
+write over budget, then the first synchronous one. */
+static struct cfa779_cmd *
+cfa779_next_cmd (struct cfa779_data *data, unsigned int *wait)
+{
+    struct cfa779_cmd *cmd = NULL, *c;
+
+    *wait = 0;
+    spin_lock (&data->cmd_lock);
+    if (data->suspended || list_empty (&data->cmd_queue))
+        goto out;
+    cmd = list_first_entry (&data->cmd_queue, struct cfa779_cmd, list);
+    if (!cmd->done && !cfa779_budget_ok (data, cmd, wait))
+      {
+          cmd = NULL;
+          list_for_each_entry (c, &data->cmd_queue, list)
+            {
+                if (c->done)
+                  {
+                      cmd = c;
+                      break;
+                  }
+            }
+          if (!cmd)
+              goto out;
+      }
+    list_del (&cmd->list);
+    data->queued--;
+    if (cmd->code < CFA779_NUM_CODES && data->pending[cmd->code] == cmd)
+        data->pending[cmd->code] = NULL;
+  out:
+    spin_unlock (&data->cmd_lock);
+    return cmd;
+}
+
+static int cfa779_post (struct cfa779_data *data, u8 code, int len,
+                        const void *payload);
+
+/* the backlight a panel going idle is dimmed to */
+static u8
+cfa779_idle_level (struct cfa779_data *data)
+{
+    if (data->backlight == CFA779_INIT)
+        return idle_backlight;
+    return min_t (unsigned int, idle_backlight, data->backlight);
+}
+
+/* sends everything the cached state says is on the display again */
+static void
+cfa779_resync (struct cfa779_data *data)
+{
+    u8 val[2];
+    int row;
+
+    data->stats.resyncs++;
+    mutex_lock (&data->update_lock);
+    for (row = 0; row < CFA779_NUM_GLYPHS; row++)
+        if (data->cgram_valid & (1 << row))
+          {
+              u8 glyph[9];
+
+              glyph[0] = row;
+              memcpy (&glyph[1], data->cgram[row], 8);
+              cfa779_post (data, 3, 9, glyph);
+          }
+    for (row = 0; row < CFA779_NUM_ROWS; row++)
+        if (data->shadow_valid & (1 << row))
+            cfa779_post (data, row + 1, CFA779_NUM_COLUMNS,
+                         data->shadow[row]);
+    if (data->cursor_row != CFA779_INIT)
+      {
+          val[0] = data->cursor_col;
+          val[1] = data->cursor_row;
+          cfa779_post (data, 4, 2, val);
+      }
+    if (data->cursor != CFA779_INIT)
+        cfa779_post (data, 5, 1, &data->cursor);
+    if (data->contrast != CFA779_INIT)
+        cfa779_post (data, 6, 1, &data->contrast);
+    if (data->idle)
+      {
+          val[0] = cfa779_idle_level (data);
+          cfa779_post (data, 7, 1, val);
+      }
+    else if (data->backlight != CFA779_INIT)
+        cfa779_post (data, 7, 1, &data->backlight);
+    mutex_unlock (&data->update_lock);
+}
+
+/* a key press or display change: wakes an idle panel and restarts the
+idle timeout, also one set through sysfs since. Called with update_lock
+held. */
+static void
+__cfa779_activity (struct cfa779_data *data)
+{
+    u8 level;
+
+    data->last_activity = jiffies;
+    if (data->idle)
+      {
+          data->idle = false;
+          /* the power-on backlight is unknown, so that falls back to
+             full */
+          level = data->backlight;
+          if (level == CFA779_INIT)
+              level = CFA779_MAX_BACKLIGHT;
+          cfa779_post (data, 7, 1, &level);
+      }
+    if (idle_timeout && !delayed_work_pending (&data->idle_work))
+        schedule_delayed_work (&data->idle_work,
+                               msecs_to_jiffies (idle_timeout * 1000));
+}
+
+static void
+cfa779_idle_work (struct work_struct *work)
+{
+    struct cfa779_data *data =
+        container_of (work, struct cfa779_data, idle_work.work);
+    unsigned long due;
+    u8 level;
+
+    if (!idle_timeout)
+        return;
+
+    mutex_lock (&data->update_lock);
+    due = data->last_activity + msecs_to_jiffies (idle_timeout * 1000);
+    if (data->idle)
+        ;
+    else if (time_before (jiffies, due))
+        schedule_delayed_work (&data->idle_work, due - jiffies);
+    else
+      {
+          data->idle = true;
+          level = cfa779_idle_level (data);
+          cfa779_post (data, 7, 1, &level);
+      }
+    mutex_unlock (&data->update_lock);
+}
+
+/* a few failures in a row put the device in degraded mode: no retries
+and slow keypad polling, so we don't add to the contention. The first
+exchange that works again ends it and resends the display, which may
+have been reset or missed writes meanwhile. */
+static void
+cfa779_bus_health (struct cfa779_data *data, bool ok)
+{
+    if (ok)
+      {
+          data->failures = 0;
+          if (data->degraded)
+            {
+                data->degraded = false;
+                dev_info (&data->client->dev, "bus recovered\n");
+                cfa779_resync (data);
+            }
+          return;
+      }
+    if (++data->failures >= CFA779_DEGRADE_AFTER && !data->degraded)
+      {
+          data->degraded = true;
+          data->stats.degraded++;
+          dev_warn (&data->client->dev, "%u exchanges failed in a row, "
+                    "backing off\n", data->failures);
+      }
+}
+
+/* cfa779_exchange() with up to 'retries' retries of commands which are
+safe to repeat, backing off exponentially with jitter so that devices
+sharing the bus don't retry in step. For those, a reply the device
+flagged as failed counts as a failure too: it rejects packets that were
+damaged on the way. The last reply is returned either way. */
+static int
+cfa779_exchange_retry (struct cfa779_data *data, u8 code, int len,
+                       const u8 * payload, u8 * reply)
+{
+    unsigned int delay = CFA779_BACKOFF_MIN;
+    bool safe = code < CFA779_NUM_CODES &&
+        (CFA779_RETRY_MASK & (1 << code));
+    unsigned int i;
+    bool ok;
+    int ret;
+
+    for (i = 0;; i++)
+      {
+          ret = cfa779_exchange (data, code, len, payload, reply);
+          ok = ret && !(safe && reply &&
+                        data->last_status == CFA779_REPLY_ERROR);
+          if (ok || !safe || data->degraded || i >= retries)
+              break;
+          data->stats.retries++;
+          msleep (delay / 2 + random32 () % (delay / 2 + 1));
+          delay = min_t (unsigned int, delay * 2, CFA779_BACKOFF_MAX);
+      }
+    if (!ok)
+        data->stats.failed++;
+    cfa779_bus_health (data, ok);
+    return ret;
+}
+
+/* forgets the cached state a write of each code in mask was meant to
+set, so the next store sends it again */
+static void
+cfa779_invalidate (struct cfa779_data *data, u16 mask)
+{
+    mutex_lock (&data->update_lock);
+    if (mask & (1 << 1))
+        data->shadow_valid &= ~1;
+    if (mask & (1 << 2))
+        data->shadow_valid &= ~2;
+    if (mask & (1 << 3))
+        data->cgram_valid = 0;
+    if (mask & (1 << 4))
+      {
+          data->cursor_row = CFA779_INIT;
+          data->cursor_col = CFA779_INIT;
+      }
+    if (mask & (1 << 5))
+        data->cursor = CFA779_INIT;
+    if (mask & (1 << 6))
+        data->contrast = CFA779_INIT;
+    if (mask & (1 << 7))
+        data->backlight = CFA779_INIT;
+    mutex_unlock (&data->update_lock);
+}
+
+/* checks the reply to a write of code; ret is what the exchange returned */
+static void
+cfa779_check_ack (struct cfa779_data *data, u8 code, u16 mask, int ret,
+                  const u8 * tb)
+{
+    data->stats.acks++;
+    if (ret && (tb[0] & 0xBF) == code)
+        return;
+    data->stats.ack_failed++;
+    cfa779_dbg (&data->client->dev, "write of 0x%04X not acknowledged\n",
+                mask);
+    cfa779_invalidate (data, mask);
+}
+
+/* the device only keeps the reply to its last command, so deferred mode
+checks that one when the batch ends and blames the whole batch for a
+failure */
+static void
+cfa779_settle_acks (struct cfa779_data *data)
+{
+    u8 tb[CFA779_REPLY_SIZE];
+    int ret;
+
+    if (!data->ack_count)
+        return;
+    ret = lcd_check_reply (data->client, data->ack_code, -1, tb);
+    cfa779_bus_health (data, ret != 0);
+    cfa779_check_ack (data, data->ack_code, data->ack_mask, ret, tb);
+    data->ack_mask = 0;
+    data->ack_count = 0;
+}
+
+static void
+cfa779_write (struct cfa779_data *data, struct cfa779_cmd *cmd)
+{
+    u8 tb[CFA779_REPLY_SIZE];
+    int ret;
+
+    switch (data->ack_mode)
+      {
+      case CFA779_ACK_VERIFIED:
+          ret = cfa779_exchange_retry (data, cmd->code, cmd->len,
+                                       cmd->payload, tb);
+          cfa779_check_ack (data, cmd->code, 1 << cmd->code, ret, tb);
+          break;
+      case CFA779_ACK_DEFERRED:
+          cfa779_exchange_retry (data, cmd->code, cmd->len, cmd->payload,
+                                 NULL);
+          data->ack_code = cmd->code;
+          data->ack_mask |= 1 << cmd->code;
+          if (++data->ack_count >= CFA779_ACK_BATCH)
+              cfa779_settle_acks (data);
+          break;
+      default:
+          cfa779_exchange_retry (data, cmd->code, cmd->len, cmd->payload,
+                                 NULL);
+      }
+}
+
+static void
+cfa779_run_queue (struct cfa779_data *data)
+{
+    struct cfa779_cmd *cmd;
+    unsigned int wait;
+
+    for (;;)
+      {
+          if (cfa779_poll_waiting (data))
+            {
+                /* go back in line behind the poll */
+                queue_work (data->wq, &data->cmd_work);
+                break;
+            }
+          cmd = cfa779_next_cmd (data, &wait);
+          if (!cmd)
+            {
+                if (wait)
+                    queue_delayed_work (data->wq, &data->throttle_work,
+                                        msecs_to_jiffies (wait));
+                break;
+            }
+
+          if (cmd->done)
+            {
+                /* its reply would replace the one still unchecked */
+                cfa779_settle_acks (data);
+                data->last_status = CFA779_REPLY_NONE;
+                cmd->result = cfa779_exchange_retry (data, cmd->code,
+                                                     cmd->len, cmd->payload,
+                                                     cmd->reply);
+                cmd->status = data->last_status;
+                complete (cmd->done);
+            }
+          else
+            {
+                cfa779_write (data, cmd);
+                kfree (cmd);
+            }
+      }
+    cfa779_settle_acks (data);
+}
+
+static void
+cfa779_cmd_work (struct work_struct *work)
+{
+    cfa779_run_queue (container_of (work, struct cfa779_data, cmd_work));
+}
+
+static void
+cfa779_throttle_work (struct work_struct *work)
+{
+    cfa779_run_queue (container_of (work, struct cfa779_data,
+                                    throttle_work.work));
+}
+
+/* called with cmd_lock held */
+static void
+cfa779_enqueue (struct cfa779_data *data, struct cfa779_cmd *cmd)
+{
+    list_add_tail (&cmd->list, &data->cmd_queue);
+    if (++data->queued > data->queue_max)
+        data->queue_max = data->queued;
+}
+
+/* queues a write without waiting for it; a queued write of the same
+coalescible command is updated in place instead */
+static int
+cfa779_post (struct cfa779_data *data, u8 code, int len, const void *payload)
+{
+    struct cfa779_cmd *cmd;
+    struct cfa779_cmd *old = NULL;
+    bool kick;
+
+    if (len > CFA779_MAX_PAYLOAD)
+        len = CFA779_MAX_PAYLOAD;
+
+    cmd = kzalloc (sizeof (*cmd), GFP_KERNEL);
+    if (!cmd)
+        return -ENOMEM;
+    cmd->code = code;
+    cmd->len = len;
+    memcpy (cmd->payload, payload, len);
+
+    spin_lock (&data->cmd_lock);
+    if (code < CFA779_NUM_CODES && (CFA779_COALESCE_MASK & (1 << code)))
+      {
+          old = data->pending[code];
+          if (old)
+            {
+                old->len = cmd->len;
+                memcpy (old->payload, cmd->payload, sizeof (old->payload));
+                data->elided++;
+                data->stats.dropped++;
+            }
+          else
+              data->pending[code] = cmd;
+      }
+    if (!old)
+        cfa779_enqueue (data, cmd);
+    /* while suspended commands wait in the queue, resume starts it */
+    kick = !old && !data->suspended;
+    spin_unlock (&data->cmd_lock);
+
+    if (old)
+        kfree (cmd);
+    if (kick)
+        queue_work (data->wq, &data->cmd_work);
+    return 0;
+}
+
+/* sends a command and waits for its reply, which is copied to reply
+(CFA779_REPLY_SIZE bytes); returns reply length or 0 if error, and the
+CFA779_REPLY_* verdict in status if that is not NULL.
+Must not be called from the bus workqueue. */
+static int
+cfa779_xfer_status (struct cfa779_data *data, u8 code, int len,
+                    const void *payload, u8 * reply, u8 * status)
+{
+    DECLARE_COMPLETION_ONSTACK (done);
+    struct cfa779_cmd cmd;
+    bool kick;
+
+    memset (&cmd, 0, sizeof (cmd));
+    if (len > CFA779_MAX_PAYLOAD)
+        len = CFA779_MAX_PAYLOAD;
+    cmd.code = code;
+    cmd.len = len;
+    memcpy (cmd.payload, payload, len);
+    cmd.reply = reply;
+    cmd.done = &done;
+
+    spin_lock (&data->cmd_lock);
+    cfa779_enqueue (data, &cmd);
+    kick = !data->suspended;
+    spin_unlock (&data->cmd_lock);
+    if (kick)
+        queue_work (data->wq, &data->cmd_work);
+
+    wait_for_completion (&done);
+    if (status)
+        *status = cmd.status;
+    return cmd.result;
+}
+
+static int
+cfa779_xfer (struct cfa779_data *data, u8 code, int len, const void *payload,
+             u8 * reply)
+{
+    return cfa779_xfer_status (data, code, len, payload, reply, NULL);
+}
+
+static int
+cfa779_init_queue (struct cfa779_data *data)
+{
+    spin_lock_init (&data->cmd_lock);
+    INIT_LIST_HEAD (&data->cmd_queue);
+    memset (data->pending, 0, sizeof (data->pending));
+    data->suspended = false;
+    INIT_WORK (&data->cmd_work, cfa779_cmd_work);
+    INIT_DELAYED_WORK (&data->throttle_work, cfa779_throttle_work);
+    data->tokens = 0;
+    data->token_stamp = jiffies;
+    data->draining = false;
+    data->queued = 0;
+    data->queue_max = 0;
+    snprintf (data->wqname, sizeof (data->wqname), "cfa779-%s",
+              dev_name (&data->client->dev));
+    data->wq = create_singlethread_workqueue (data->wqname);
+    if (!data->wq)
+        return -ENOMEM;
+    return 0;
+}
+
+/* sends whatever is still queued and stops the bus thread */
+static void
+cfa779_destroy_queue (struct cfa779_data *data)
+{
+    data->draining = true;
+    cancel_delayed_work_sync (&data->throttle_work);
+    queue_work (data->wq, &data->cmd_work);
+    flush_workqueue (data->wq);
+    destroy_workqueue (data->wq);
+}
 
-    lcd_send_packet (client, 8, 0, NULL);
-    if (lcd_check_reply (client, 8, -1, tb) != 0)
+// code 8
+/* the reply is the code, the version string and the crc */
+static void
+lcd_parse_version (const u8 * tb, int i, char *buf, int len)
+{
+    if (i >= 3)
       {
-          if (tb[0] >= 3)
-              tb[0] -= 3;
-          if (len >= tb[0])
-              len = tb[0];
-          memcpy (buf, &tb[1], len);
-          buf[len] = 0;
+          i -= 3;
+          if (i > len)
+              i = len;
+          memcpy (buf, &tb[1], i);
+          buf[i] = 0;
       }
     else
         buf[0] = 0;
+}
+
+/* returns 0, or -EIO with buf untouched if there was no good reply */
+static int
+lcd_get_version (struct cfa779_data *data, char *buf, int len)
+{
+    u8 tb[CFA779_REPLY_SIZE];
+    u8 status;
+    int i;
 
+    i = cfa779_xfer_status (data, 8, 0, NULL, tb, &status);
+    if (i < 3 || status != CFA779_REPLY_OK)
+        return -EIO;
+    lcd_parse_version (tb, i, buf, len);
+    return 0;
 }
 
+/* the hardware version can't change while we are bound, so it is read
+   once after probe and again only on request */
 static ssize_t
 cfa779_show_version (struct device *dev, struct device_attribute *attr,
                      char *buf)
 {
-    struct i2c_client *client = to_i2c_client (dev);
-    char tb[128];
-    memset (tb, 0, sizeof (tb));
-    lcd_get_version (client, tb, sizeof (tb) - 1);
-    return sprintf (buf, "cfa779 LCD Driver Version 1.1 (Hardware %s)\n", tb);
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    ssize_t ret;
+
+    flush_work (&data->init_work);
+    mutex_lock (&data->update_lock);
+    ret = sprintf (buf, "cfa779 LCD Driver Version 1.1 (Hardware %s)\n",
+                   data->version);
+    mutex_unlock (&data->update_lock);
+    return ret;
+}
+
+static ssize_t
+cfa779_set_refresh_version (struct device *dev, struct device_attribute *attr,
+                            const char *buf, size_t count)
+{
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    char tb[CFA779_VERSION_LEN];
+
+    /* a failed query keeps the version we have */
+    if (lcd_get_version (data, tb, sizeof (tb) - 1))
+        return -EIO;
+
+    mutex_lock (&data->update_lock);
+    memcpy (data->version, tb, sizeof (data->version));
+    mutex_unlock (&data->update_lock);
+    return count;
 }
 
 static ssize_t
@@ -276,286 +1339,1453 @@ cfa779_show_cursor_style (struct device *dev, struct device_attribute *attr,
     return sprintf (buf, "%u\n", data->cursor);
 }
 
-// code 9
 static ssize_t
-cfa779_show_keypad (struct device *dev, struct device_attribute *attr,
+cfa779_show_elided (struct device *dev, struct device_attribute *attr,
                     char *buf)
 {
-    struct i2c_client *client = to_i2c_client (dev);
-    u8 tb[256];
-    int i, j, k;
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    return sprintf (buf, "%lu\n", data->elided);
+}
+
+static ssize_t
+cfa779_show_transport (struct device *dev, struct device_attribute *attr,
+                       char *buf)
+{
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    return sprintf (buf, "%s\n", data->use_i2c ? "i2c" : "smbus");
+}
+
+/* commands queued now and at most, writes replaced while queued and
+times display writes waited for bandwidth */
+static ssize_t
+cfa779_show_queue (struct device *dev, struct device_attribute *attr,
+                   char *buf)
+{
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    return sprintf (buf, "%u %u %lu %lu\n", data->queued, data->queue_max,
+                    data->stats.dropped, data->stats.throttled);
+}
+
+static const char *const cfa779_ack_modes[] = {
+    [CFA779_ACK_NONE] = "none",
+    [CFA779_ACK_VERIFIED] = "verified",
+    [CFA779_ACK_DEFERRED] = "deferred",
+};
+
+/* lists the modes with the current one in brackets */
+static ssize_t
+cfa779_show_ack_mode (struct device *dev, struct device_attribute *attr,
+                      char *buf)
+{
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE (cfa779_ack_modes); i++)
+        len += sprintf (buf + len, i == data->ack_mode ? "[%s] " : "%s ",
+                        cfa779_ack_modes[i]);
+    buf[len - 1] = '\n';
+    return len;
+}
+
+static ssize_t
+cfa779_set_ack_mode (struct device *dev, struct device_attribute *attr,
+                     const char *buf, size_t count)
+{
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE (cfa779_ack_modes); i++)
+        if (sysfs_streq (buf, cfa779_ack_modes[i]))
+          {
+              data->ack_mode = i;
+              return count;
+          }
+    return -EINVAL;
+}
+
+/* request/reply exchanges done, their average and worst round-trip
+time in microseconds */
+static ssize_t
+cfa779_show_latency (struct device *dev, struct device_attribute *attr,
+                     char *buf)
+{
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    unsigned long count = data->xfer_count;
+    u64 avg = data->xfer_time_us;
+
+    if (count)
+        do_div (avg, count);
+    return sprintf (buf, "%lu %llu %u\n", count, (unsigned long long) avg,
+                    data->xfer_max_us);
+}
+
+/* key edges reported and the average and worst time in microseconds
+between the poll before the edge and its report, the bound on how
+long a key event waited in the device */
+static ssize_t
+cfa779_show_key_latency (struct device *dev, struct device_attribute *attr,
+                         char *buf)
+{
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    unsigned long count = data->key_events;
+    u64 avg = data->key_latency_us;
+
+    if (count)
+        do_div (avg, count);
+    return sprintf (buf, "%lu %llu %u\n", count, (unsigned long long) avg,
+                    data->key_latency_max_us);
+}
+
+// code 9
+static ssize_t
+cfa779_show_keypad (struct device *dev, struct device_attribute *attr,
+                    char *buf)
+{
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    u8 tb[CFA779_KEYPAD_SIZE];
+    char out[64];
+    unsigned int seq;
+    unsigned long stamp;
+    bool valid;
+    int j, k;
+
+    /* the poller keeps the snapshot fresh while the input device is
+       open; otherwise read the keypad once, through the poller so the
+       edges it consumes still reach the input layer. The poller's
+       current interval is the limit, so reads while it backs off or
+       idles do not poll behind its back */
+    stamp = data->keypad_stamp;
+    if (!data->keypad_valid
+        || time_after (jiffies,
+                       stamp + msecs_to_jiffies (data->cur_interval)))
+      {
+          queue_work (data->wq, &data->keypad_work);
+          flush_work (&data->keypad_work);
+      }
+
+    do
+      {
+          seq = read_seqbegin (&data->keypad_lock);
+          valid = data->keypad_valid;
+          memcpy (tb, data->keypad, sizeof (tb));
+      }
+    while (read_seqretry (&data->keypad_lock, seq));
+
+    if (!valid)
+        return 0;
+
+    k = 0;
+    for (j = 0; j < CFA779_KEYPAD_SIZE; j++)
+        k += sprintf (&out[k], "%u ", tb[j]);
+
+    return sprintf (buf, "%s\n", out);
+}
+
+/* most recent key edges, oldest first: time in us, keycode, value */
+static ssize_t
+cfa779_show_keypad_events (struct device *dev, struct device_attribute *attr,
+                           char *buf)
+{
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    struct cfa779_edge edges[CFA779_EDGE_RING];
+    unsigned long n, i;
+    unsigned int seq;
+    ssize_t len = 0;
+
+    do
+      {
+          seq = read_seqbegin (&data->keypad_lock);
+          n = data->nedges;
+          memcpy (edges, data->edges, sizeof (edges));
+      }
+    while (read_seqretry (&data->keypad_lock, seq));
+
+    for (i = n > CFA779_EDGE_RING ? n - CFA779_EDGE_RING : 0; i < n; i++)
+      {
+          struct cfa779_edge *e = &edges[i % CFA779_EDGE_RING];
+          len += sprintf (buf + len, "%lld %u %u\n", (long long) e->us,
+                          e->keycode, e->value);
+      }
+    return len;
+}
+
+// code 6
+static ssize_t
+cfa779_set_contrast (struct device *dev, struct device_attribute *attr,
+                     const char *buf, size_t count)
+{
+    u8 vbyte;
+    int err = 0;
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    unsigned long val = simple_strtoul (buf, NULL, 10);
+    if (val > CFA779_MAX_CONTRAST)
+        return -EINVAL;
+    vbyte = val;
+    mutex_lock (&data->update_lock);
+    if (data->contrast == val)
+        data->elided++;
+    else
+      {
+          __cfa779_activity (data);
+          err = cfa779_post (data, 6, 1, &vbyte);
+//if (lcd_check_reply(client,6,0,NULL)!=0) 
+          if (!err)
+              data->contrast = val;
+      }
+    mutex_unlock (&data->update_lock);
+    return err ? err : count;
+}
+
+// code 5
+/* called with update_lock held */
+static int
+__cfa779_set_cursor_style (struct cfa779_data *data, u8 val)
+{
+    int err = 0;
+
+    if (data->cursor == val)
+        data->elided++;
+    else
+      {
+          __cfa779_activity (data);
+          err = cfa779_post (data, 5, 1, &val);
+//if (lcd_check_reply(client,5,0,NULL)!=0)
+          if (!err)
+              data->cursor = val;
+      }
+    return err;
+}
+
+static ssize_t
+cfa779_set_cursor_style (struct device *dev, struct device_attribute *attr,
+                         const char *buf, size_t count)
+{
+    int err = 0;
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    unsigned long val = simple_strtoul (buf, NULL, 10);
+    if (val > CFA779_MAX_CURSOR_STYLE)
+        return -EINVAL;
+    mutex_lock (&data->update_lock);
+    err = __cfa779_set_cursor_style (data, val);
+    mutex_unlock (&data->update_lock);
+    return err ? err : count;
+}
+
+// code 4
+/* called with update_lock held */
+static int
+__cfa779_set_cursor_pos (struct cfa779_data *data, u8 y, u8 x)
+{
+    u8 val[2];
+    int err = 0;
+
+    val[0] = x;
+    val[1] = y;
+
+    if (data->cursor_row == y && data->cursor_col == x)
+        data->elided++;
+    else
+      {
+          __cfa779_activity (data);
+          err = cfa779_post (data, 4, 2, val);
+//lcd_check_reply(client,4,0,NULL);
+          if (!err)
+            {
+                data->cursor_row = y;
+                data->cursor_col = x;
+            }
+      }
+    return err;
+}
+
+static ssize_t
+cfa779_set_cursor_pos (struct device *dev, struct device_attribute *attr,
+                       const char *buf, size_t count)
+{
+    unsigned int x, y;
+    int err = 0;
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+
+    if ((sscanf (buf, "%u %u", &y, &x) != 2) || (x > CFA779_NUM_COLUMNS)
+        || (y >= CFA779_NUM_ROWS))
+        return -EINVAL;
+
+    mutex_lock (&data->update_lock);
+    err = __cfa779_set_cursor_pos (data, y, x);
+    mutex_unlock (&data->update_lock);
+    return err ? err : count;
+}
+
+// code 7
+static ssize_t
+cfa779_set_backlight (struct device *dev, struct device_attribute *attr,
+                      const char *buf, size_t count)
+{
+    u8 vbyte;
+    int err = 0;
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    unsigned long val = simple_strtoul (buf, NULL, 10);
+    if (val > CFA779_MAX_BACKLIGHT)
+        return -EINVAL;
+    vbyte = val;
+    mutex_lock (&data->update_lock);
+    /* lights an idle panel up again even if val is unchanged */
+    __cfa779_activity (data);
+    if (data->backlight == val)
+        data->elided++;
+    else
+      {
+          err = cfa779_post (data, 7, 1, &vbyte);
+//if (lcd_check_reply(client,7,0,NULL)!=0) 
+          if (!err)
+              data->backlight = val;
+      }
+    mutex_unlock (&data->update_lock);
+    return err ? err : count;
+}
+
+static ssize_t
+cfa779_set_rawcmd (struct device *dev, struct device_attribute *attr,
+                   const char *buf, size_t count)
+{
+    char val[16];
+    char tb[CFA779_REPLY_SIZE];
+    int i, j, k;
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    size_t mycnt;
+
+    mycnt = count;
+    if (mycnt > 17)
+        mycnt = 17;
+    mycnt--;
+
+    memcpy (val, &buf[1], mycnt);
+    i = cfa779_xfer (data, buf[0], mycnt, val, tb);
+
+    k = 64;
+    for (j = 0; j < i; j++)
+        k += sprintf (&tb[k], "%02X ", tb[j] & 0xFF);
+    printk ("Result(%d): %s\n", i, &tb[64]);
+    return count;
+}
+
+// code 1
+// code 2
+/* writes one full row, it is only sent if it differs from what the
+shadow says is already displayed; called with update_lock held */
+static int
+__lcd_put_row (struct cfa779_data *data, int row, const char *val)
+{
+    int err = 0;
+
+    if ((data->shadow_valid & (1 << row))
+        && !memcmp (data->shadow[row], val, CFA779_NUM_COLUMNS))
+        data->elided++;
+    else
+      {
+          err = cfa779_post (data, row + 1, CFA779_NUM_COLUMNS, val);
+//lcd_check_reply(client,line,0,NULL);
+          if (!err)
+            {
+                memcpy (data->shadow[row], val, CFA779_NUM_COLUMNS);
+                data->shadow_valid |= 1 << row;
+            }
+      }
+    return err;
+}
+
+/* as above, replacing a marquee running on the row */
+static int
+__lcd_write_row (struct cfa779_data *data, int row, const char *val)
+{
+    data->marquee_active &= ~(1 << row);
+    if (!(data->shadow_valid & (1 << row))
+        || memcmp (data->shadow[row], val, CFA779_NUM_COLUMNS))
+        __cfa779_activity (data);
+    return __lcd_put_row (data, row, val);
+}
+
+static int
+lcd_write_row (struct cfa779_data *data, int row, const char *val)
+{
+    int err;
+
+    mutex_lock (&data->update_lock);
+    err = __lcd_write_row (data, row, val);
+    mutex_unlock (&data->update_lock);
+    return err;
+}
+
+static ssize_t
+lcd_set_text (struct device *dev, const char *buf, size_t count, u8 line)
+{
+    char val[CFA779_NUM_COLUMNS];
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    size_t mycnt;
+    int err;
+
+    memset (val, 0x20, sizeof (val));
+    mycnt = count;
+    if (mycnt > CFA779_NUM_COLUMNS)
+        mycnt = CFA779_NUM_COLUMNS;
+    memcpy (val, buf, mycnt);
+    err = lcd_write_row (data, line - 1, val);
+    return err ? err : count;
+}
+
+static ssize_t
+cfa779_set_line1 (struct device *dev, struct device_attribute *attr,
+                  const char *buf, size_t count)
+{
+    return lcd_set_text (dev, buf, count, 1);
+}
+
+static ssize_t
+cfa779_set_line2 (struct device *dev, struct device_attribute *attr,
+                  const char *buf, size_t count)
+{
+    return lcd_set_text (dev, buf, count, 2);
+}
+
+/* shows the marquee texts from their current columns on; called with
+update_lock held */
+static void
+__cfa779_marquee_show (struct cfa779_data *data, int row)
+{
+    char val[CFA779_NUM_COLUMNS];
+    int i, len = data->marquee_len[row];
+
+    for (i = 0; i < CFA779_NUM_COLUMNS; i++)
+        val[i] = data->marquee[row][(data->marquee_pos[row] + i) % len];
+    __lcd_put_row (data, row, val);
+}
+
+static void
+cfa779_marquee_work (struct work_struct *work)
+{
+    struct cfa779_data *data =
+        container_of (work, struct cfa779_data, marquee_work.work);
+    bool paused = data->keys_down
+        || time_before (jiffies, data->marquee_resume);
+    int row;
+
+    mutex_lock (&data->update_lock);
+    if (!data->marquee_active)
+      {
+          mutex_unlock (&data->update_lock);
+          return;
+      }
+    for (row = 0; row < CFA779_NUM_ROWS && !paused; row++)
+        if (data->marquee_active & (1 << row))
+          {
+              data->marquee_pos[row] =
+                  (data->marquee_pos[row] + 1) % data->marquee_len[row];
+              __cfa779_marquee_show (data, row);
+          }
+    mutex_unlock (&data->update_lock);
+
+    schedule_delayed_work (&data->marquee_work,
+                           msecs_to_jiffies (max (marquee_speed, 50U)));
+}
+
+/* text that fits is shown like line1/line2 does, longer text scrolls
+left one column every marquee_speed ms, with a gap after its end */
+static ssize_t
+lcd_set_marquee (struct device *dev, const char *buf, size_t count, u8 line)
+{
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    int row = line - 1;
+    size_t len = count;
+    ssize_t err;
+
+    if (len && buf[len - 1] == '\n')
+        len--;
+    if (len <= CFA779_NUM_COLUMNS)
+      {
+          err = lcd_set_text (dev, buf, len, line);
+          return err < 0 ? err : count;
+      }
+    len = min_t (size_t, len, CFA779_MARQUEE_MAX - CFA779_MARQUEE_GAP);
+
+    mutex_lock (&data->update_lock);
+    memcpy (data->marquee[row], buf, len);
+    memset (&data->marquee[row][len], ' ', CFA779_MARQUEE_GAP);
+    data->marquee_len[row] = len + CFA779_MARQUEE_GAP;
+    data->marquee_pos[row] = 0;
+    data->marquee_active |= 1 << row;
+    __cfa779_marquee_show (data, row);
+    mutex_unlock (&data->update_lock);
+
+    schedule_delayed_work (&data->marquee_work,
+                           msecs_to_jiffies (max (marquee_speed, 50U)));
+    return count;
+}
+
+static ssize_t
+cfa779_set_marquee1 (struct device *dev, struct device_attribute *attr,
+                     const char *buf, size_t count)
+{
+    return lcd_set_marquee (dev, buf, count, 1);
+}
+
+static ssize_t
+cfa779_set_marquee2 (struct device *dev, struct device_attribute *attr,
+                     const char *buf, size_t count)
+{
+    return lcd_set_marquee (dev, buf, count, 2);
+}
+
+/* binary screen attribute: both rows (32 bytes), optionally followed by
+the cursor row and column, optionally followed by the cursor style.
+Applied in that order as one batch, parts already displayed are
+skipped. */
+static ssize_t
+cfa779_write_screen (struct kobject *kobj, struct bin_attribute *attr,
+                     char *buf, loff_t off, size_t count)
+{
+    struct device *dev = container_of (kobj, struct device, kobj);
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    u8 *cur = &buf[CFA779_FRAME_SIZE];
+    int row, err = 0;
+
+    if (off != 0 || (count != CFA779_FRAME_SIZE
+                     && count != CFA779_FRAME_SIZE + 2
+                     && count != CFA779_FRAME_SIZE + 3))
+        return -EINVAL;
+    if (count > CFA779_FRAME_SIZE
+        && (cur[1] > CFA779_NUM_COLUMNS || cur[0] >= CFA779_NUM_ROWS))
+        return -EINVAL;
+    if (count > CFA779_FRAME_SIZE + 2 && cur[2] > CFA779_MAX_CURSOR_STYLE)
+        return -EINVAL;
+
+    mutex_lock (&data->update_lock);
+    for (row = 0; row < CFA779_NUM_ROWS && !err; row++)
+        err = __lcd_write_row (data, row, &buf[row * CFA779_NUM_COLUMNS]);
+    if (!err && count > CFA779_FRAME_SIZE)
+        err = __cfa779_set_cursor_pos (data, cur[0], cur[1]);
+    if (!err && count > CFA779_FRAME_SIZE + 2)
+        err = __cfa779_set_cursor_style (data, cur[2]);
+    mutex_unlock (&data->update_lock);
+    return err ? err : count;
+}
+
+// code 3
+/* loads a glyph into a slot unless it is already there; called with
+update_lock held */
+static int
+__cfa779_set_glyph (struct cfa779_data *data, u8 slot, const u8 * bitmap)
+{
+    u8 val[9];
+    int err;
+
+    data->cgram_used[slot] = ++data->cgram_clock;
+    if ((data->cgram_valid & (1 << slot))
+        && !memcmp (data->cgram[slot], bitmap, 8))
+      {
+          data->elided++;
+          return 0;
+      }
+
+    __cfa779_activity (data);
+    val[0] = slot;
+    memcpy (&val[1], bitmap, 8);
+    err = cfa779_post (data, 3, 9, val);
+//lcd_check_reply(client,3,0,NULL);
+    if (!err)
+      {
+          memcpy (data->cgram[slot], bitmap, 8);
+          data->cgram_valid |= 1 << slot;
+      }
+    return err;
+}
+
+/* finds or loads a slot holding bitmap. Slots in keep are not replaced,
+nor, if it can be helped, slots shown on the display; otherwise the
+least recently used one is. Returns the slot or a negative error. */
+static int
+cfa779_glyph_slot (struct cfa779_data *data, const u8 * bitmap, u8 keep)
+{
+    u8 shown = 0;
+    int i, j, victim = -1;
+
+    for (i = 0; i < CFA779_NUM_GLYPHS; i++)
+        if ((data->cgram_valid & (1 << i))
+            && !memcmp (data->cgram[i], bitmap, 8))
+          {
+              data->cgram_used[i] = ++data->cgram_clock;
+              return i;
+          }
+
+    for (i = 0; i < CFA779_NUM_ROWS; i++)
+        if (data->shadow_valid & (1 << i))
+            for (j = 0; j < CFA779_NUM_COLUMNS; j++)
+                if ((u8) data->shadow[i][j] < 2 * CFA779_NUM_GLYPHS)
+                    shown |= 1 << (data->shadow[i][j] & 7);
+
+    for (i = 0; i < CFA779_NUM_GLYPHS; i++)
+      {
+          if (keep & (1 << i))
+              continue;
+          if (!(data->cgram_valid & (1 << i)))
+            {
+                victim = i;
+                break;
+            }
+          if (victim < 0 || (!(shown & (1 << i)) && (shown & (1 << victim)))
+              || (!(shown & (1 << i)) == !(shown & (1 << victim))
+                  && data->cgram_used[i] < data->cgram_used[victim]))
+              victim = i;
+      }
+    if (victim < 0)
+        return -ENOSPC;
+
+    i = __cfa779_set_glyph (data, victim, bitmap);
+    return i ? i : victim;
+}
+
+/* defines user character, fyrst byte is character code (0..7),
+other 8 bytes are bitmasks */
+static ssize_t
+cfa779_set_character (struct device *dev, struct device_attribute *attr,
+                      const char *buf, size_t count)
+{
+    u8 val[9];
+    unsigned int bmp[9];
+    int i, err;
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+
+    if (sscanf (buf, "%u %u %u %u %u %u %u %u %u", &bmp[0], &bmp[1],
+                &bmp[2], &bmp[3], &bmp[4], &bmp[5], &bmp[6], &bmp[7],
+                &bmp[8]) != 9)
+        return -EINVAL;
+
+    for (i = 0; i < 9; i++)
+        val[i] = bmp[i] & 0xFF;
+
+    mutex_lock (&data->update_lock);
+    if (val[0] < CFA779_NUM_GLYPHS)
+        err = __cfa779_set_glyph (data, val[0], &val[1]);
+    else
+        err = cfa779_post (data, 3, 9, val);
+    mutex_unlock (&data->update_lock);
+    return err ? err : count;
+}
+
+/* "row col width value max": draws a horizontal bar of width cells
+from row, col showing value out of max, at pixel resolution. The
+partial and full cell glyphs are kept in the user characters, so an
+animated bar settles down to one row write per frame. */
+static ssize_t
+cfa779_set_bargraph (struct device *dev, struct device_attribute *attr,
+                     const char *buf, size_t count)
+{
+    struct cfa779_data *data = i2c_get_clientdata (to_i2c_client (dev));
+    unsigned int row, col, width, value, max, pixels, n;
+    char val[CFA779_NUM_COLUMNS];
+    u8 bitmap[8];
+    u8 keep = 0;
+    int i, slot, err = 0;
+
+    if (sscanf (buf, "%u %u %u %u %u", &row, &col, &width, &value, &max) != 5
+        || row >= CFA779_NUM_ROWS || width == 0
+        || col >= CFA779_NUM_COLUMNS || width > CFA779_NUM_COLUMNS - col
+        || max == 0)
+        return -EINVAL;
+    /* at most 80 pixels, but the product needs 64 bits */
+    pixels = div_u64 ((u64) min (value, max) * width * CFA779_GLYPH_WIDTH,
+                      max);
+
+    mutex_lock (&data->update_lock);
+    if (data->shadow_valid & (1 << row))
+        memcpy (val, data->shadow[row], CFA779_NUM_COLUMNS);
+    else
+        memset (val, ' ', CFA779_NUM_COLUMNS);
+
+    for (i = 0; i < width; i++, pixels -= n)
+      {
+          n = min_t (unsigned int, pixels, CFA779_GLYPH_WIDTH);
+          if (!n)
+            {
+                val[col + i] = ' ';
+                continue;
+            }
+          memset (bitmap, (0x1F << (CFA779_GLYPH_WIDTH - n)) & 0x1F, 8);
+          slot = cfa779_glyph_slot (data, bitmap, keep);
+          if (slot < 0)
+            {
+                err = slot;
+                goto out;
+            }
+          keep |= 1 << slot;
+          val[col + i] = slot;
+      }
+    err = __lcd_write_row (data, row, val);
+  out:
+    mutex_unlock (&data->update_lock);
+    return err ? err : count;
+}
+
+
+int
+lcd_send_packet (struct i2c_client *client, u8 idx, int len, char *data)
+{
+    u8 val[24];
+
+    len = lcd_build_packet (val, idx, len, data);
+    trace_cfa779_send (client, idx, len - 2, &val[2]);
+    cfa779_capture_add (client, CFA779_CAP_SEND, idx, 0, val, len + 2);
+    return i2c_smbus_write_block_data (client, idx, len, &val[2]);
+}
+
+
+static int
+cfa779_detect (struct i2c_client *new_client, int kind,
+               struct i2c_board_info *info)
+{
+    struct i2c_adapter *adapter = new_client->adapter;
+
+    if (!i2c_check_functionality
+        (adapter, I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_WRITE_WORD_DATA))
+        return -ENODEV;
+
+    /*
+     * Now we do the remaining detection. A negative kind means that
+     * the driver was loaded with no force parameter (default), so we
+     * must both detect and identify the chip. A zero kind means that
+     * the driver was loaded with the force parameter, the detection
+     * step shall be skipped. A positive kind means that the driver
+     * was loaded with the force parameter and a given kind of chip is
+     * requested, so both the detection and the identification steps
+     * are skipped.
+     */
+
+    if (kind == 0)
+        kind = cfa779;
+
+    if (kind < 0)
+      {                         /* detection and identification */
+          lcd_send_packet (new_client, 0, 0, NULL);
+          if (lcd_check_reply (new_client, 0, 0, NULL) == 0)
+              return -ENODEV;
+          kind = cfa779;
+      }
+
+    strncpy (info->type, "cfa779", I2C_NAME_SIZE);
+
+    return 0;
+}
+
+/* the second half are the codes sent when a key is held for long_press */
+static const unsigned short cfa779_keymap[CFA779_NUM_KEYCODES] = {
+    [0] = KEY_UP,
+    [1] = KEY_DOWN,
+    [2] = KEY_LEFT,
+    [3] = KEY_RIGHT,
+    [4] = KEY_ENTER,
+    [5] = KEY_PAGEUP,
+    [6] = KEY_PAGEDOWN,
+    [7] = KEY_HOME,
+    [8] = KEY_END,
+    [9] = KEY_MENU,
+};
+
+/* ------------------------------------------------------------ */
+/* /dev/cfa779N: the frame is CFA779_NUM_ROWS rows of CFA779_NUM_COLUMNS
+characters. It can be written with write() or changed in place through
+mmap(), in which case page faults are used to notice the writes the same
+way fbdev deferred I/O does. Either way the flush is deferred, so that
+bursts of updates are coalesced and at most max_fps frames per second
+reach the bus; only rows that differ from the shadow are sent. */
+
+static DEFINE_IDA (cfa779_ida);
+static LIST_HEAD (cfa779_devices);
+static DEFINE_MUTEX (cfa779_devices_lock);     /* Protects cfa779_devices */
+
+/* called with gone_sem held for reading and the device not gone */
+static void cfa779_release (struct kref *kref);
+
+static void
+cfa779_schedule_flush (struct cfa779_data *data)
+{
+    unsigned long next = data->last_flush;
+    unsigned long delay = 0;
+
+    if (max_fps)
+      {
+          next += DIV_ROUND_UP (HZ, max_fps);
+          if (time_before (jiffies, next))
+              delay = next - jiffies;
+      }
+    schedule_delayed_work (&data->flush_work, delay);
+}
+
+static void
+cfa779_flush_work (struct work_struct *work)
+{
+    struct cfa779_data *data =
+        container_of (work, struct cfa779_data, flush_work.work);
+    char val[CFA779_FRAME_SIZE];
+    struct page *page = vmalloc_to_page (data->frame);
+    int row;
+
+    /* write protect the page again, so the next store through an
+       mmap() faults and schedules another flush */
+    lock_page (page);
+    page_mkclean (page);
+    unlock_page (page);
+
+    data->last_flush = jiffies;
+    memcpy (val, data->frame, sizeof (val));
+    for (row = 0; row < CFA779_NUM_ROWS; row++)
+        lcd_write_row (data, row, &val[row * CFA779_NUM_COLUMNS]);
+}
+
+static int
+cfa779_vm_fault (struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    struct cfa779_data *data = vma->vm_private_data;
+    struct page *page;
+
+    if (vmf->pgoff != 0)
+        return VM_FAULT_SIGBUS;
+
+    page = vmalloc_to_page (data->frame);
+    get_page (page);
+    if (vma->vm_file)
+        page->mapping = vma->vm_file->f_mapping;
+    page->index = vmf->pgoff;
+    vmf->page = page;
+    return 0;
+}
+
+static int
+cfa779_vm_mkwrite (struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+    struct cfa779_data *data = vma->vm_private_data;
+
+    /* the page is locked so the flush cannot clean it before the
+       store this fault is for has happened. Once the device is gone
+       the page is just memory. */
+    lock_page (vmf->page);
+    down_read (&data->gone_sem);
+    if (!data->gone)
+        cfa779_schedule_flush (data);
+    up_read (&data->gone_sem);
+    return VM_FAULT_LOCKED;
+}
+
+static const struct vm_operations_struct cfa779_vm_ops = {
+    .fault = cfa779_vm_fault,
+    .page_mkwrite = cfa779_vm_mkwrite,
+};
+
+static int
+cfa779_dev_open (struct inode *inode, struct file *file)
+{
+    struct cfa779_data *data;
+    int err = -ENODEV;
+
+    mutex_lock (&cfa779_devices_lock);
+    list_for_each_entry (data, &cfa779_devices, node)
+        if (data->miscdev.minor == iminor (inode))
+        {
+            kref_get (&data->kref);
+            file->private_data = data;
+            err = 0;
+            break;
+        }
+    mutex_unlock (&cfa779_devices_lock);
+    return err;
+}
+
+static int
+cfa779_dev_release (struct inode *inode, struct file *file)
+{
+    struct cfa779_data *data = file->private_data;
+
+    kref_put (&data->kref, cfa779_release);
+    return 0;
+}
+
+static ssize_t
+cfa779_dev_read (struct file *file, char __user *buf, size_t count,
+                 loff_t *ppos)
+{
+    struct cfa779_data *data = file->private_data;
+
+    return simple_read_from_buffer (buf, count, ppos, data->frame,
+                                    CFA779_FRAME_SIZE);
+}
+
+/* a write() continues where the last one ended, as read() does; seek
+back to 0 to start a new frame. Writes past the end fail with ENOSPC
+like they do on fbdev */
+static ssize_t
+cfa779_dev_write (struct file *file, const char __user *buf, size_t count,
+                  loff_t *ppos)
+{
+    struct cfa779_data *data = file->private_data;
+    ssize_t ret;
+
+    if (*ppos >= CFA779_FRAME_SIZE)
+        return count ? -ENOSPC : 0;
+    down_read (&data->gone_sem);
+    if (data->gone)
+        ret = -ENODEV;
+    else
+        ret = simple_write_to_buffer (data->frame, CFA779_FRAME_SIZE, ppos,
+                                      buf, count);
+    if (ret > 0)
+        cfa779_schedule_flush (data);
+    up_read (&data->gone_sem);
+    return ret;
+}
+
+static int
+cfa779_dev_mmap (struct file *file, struct vm_area_struct *vma)
+{
+    struct cfa779_data *data = file->private_data;
+
+    if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > PAGE_SIZE)
+        return -EINVAL;
+    if (data->gone)
+        return -ENODEV;
+
+    vma->vm_ops = &cfa779_vm_ops;
+    vma->vm_flags |= VM_RESERVED | VM_DONTEXPAND;
+    vma->vm_private_data = file->private_data;
+    return 0;
+}
+
+/* CFA779_IOC_RAW: runs a batch of raw commands, each one's reply and
+verdict is copied back into its struct cfa779_raw */
+static long
+cfa779_ioctl_raw (struct cfa779_data *data,
+                  struct cfa779_raw_batch __user *ubatch)
+{
+    struct cfa779_raw_batch batch;
+    struct cfa779_raw __user *ucmds;
+    struct cfa779_raw raw;
+    u8 tb[CFA779_REPLY_SIZE];
+    long ret = 0;
+    int i;
+
+    if (copy_from_user (&batch, ubatch, sizeof (batch)))
+        return -EFAULT;
+    if (batch.count > CFA779_RAW_BATCH_MAX)
+        return -EINVAL;
+    ucmds = (struct cfa779_raw __user *) (unsigned long) batch.cmds;
+
+    for (batch.done = 0; batch.done < batch.count; batch.done++)
+      {
+          if (copy_from_user (&raw, &ucmds[batch.done], sizeof (raw)))
+            {
+                ret = -EFAULT;
+                break;
+            }
+          if (raw.len > CFA779_MAX_PAYLOAD)
+            {
+                ret = -EINVAL;
+                break;
+            }
+          i = cfa779_xfer_status (data, raw.code, raw.len, raw.data, tb,
+                                  &raw.status);
+          /* the display no longer shows what the caches say it does */
+          if (raw.code < CFA779_NUM_CODES)
+              cfa779_invalidate (data, 1 << raw.code);
+          raw.reply_len = min_t (int, i, sizeof (raw.reply));
+          memcpy (raw.reply, tb, raw.reply_len);
+          if (copy_to_user (&ucmds[batch.done], &raw, sizeof (raw)))
+            {
+                ret = -EFAULT;
+                break;
+            }
+          if (signal_pending (current))
+            {
+                batch.done++;
+                ret = -EINTR;
+                break;
+            }
+      }
+
+    if (put_user (batch.done, &ubatch->done))
+        return -EFAULT;
+    return ret;
+}
+
+static long
+cfa779_dev_ioctl (struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct cfa779_data *data = file->private_data;
+    long ret;
+
+    switch (cmd)
+      {
+      case CFA779_IOC_RAW:
+          if (rawcmd == 0)
+              return -EPERM;
+          if (!capable (CAP_SYS_RAWIO))
+              return -EPERM;
+          /* remove waits for a batch in progress, not for the file */
+          down_read (&data->gone_sem);
+          if (data->gone)
+              ret = -ENODEV;
+          else
+              ret = cfa779_ioctl_raw (data, (void __user *) arg);
+          up_read (&data->gone_sem);
+          return ret;
+      }
+    return -ENOTTY;
+}
+
+static const struct file_operations cfa779_fops = {
+    .owner = THIS_MODULE,
+    .open = cfa779_dev_open,
+    .release = cfa779_dev_release,
+    .read = cfa779_dev_read,
+    .write = cfa779_dev_write,
+    .mmap = cfa779_dev_mmap,
+    .unlocked_ioctl = cfa779_dev_ioctl,
+    /* struct cfa779_raw_batch has the same layout for 32 bit tasks */
+    .compat_ioctl = cfa779_dev_ioctl,
+    .llseek = default_llseek,
+};
+
+static int
+cfa779_register_chardev (struct cfa779_data *data)
+{
+    int err;
+
+    data->frame = vmalloc (PAGE_SIZE);
+    if (!data->frame)
+        return -ENOMEM;
+    memset (data->frame, 0x20, PAGE_SIZE);
+    init_rwsem (&data->gone_sem);
+    data->gone = false;
+
+    do
+      {
+          if (!ida_pre_get (&cfa779_ida, GFP_KERNEL))
+            {
+                err = -ENOMEM;
+                goto fail1;
+            }
+          err = ida_get_new (&cfa779_ida, &data->id);
+      }
+    while (err == -EAGAIN);
+    if (err)
+        goto fail1;
+
+    snprintf (data->devname, sizeof (data->devname), "cfa779%d", data->id);
+    data->miscdev.minor = MISC_DYNAMIC_MINOR;
+    data->miscdev.name = data->devname;
+    data->miscdev.fops = &cfa779_fops;
+    data->miscdev.parent = &data->client->dev;
+    if ((err = misc_register (&data->miscdev)))
+        goto fail2;
+
+    mutex_lock (&cfa779_devices_lock);
+    list_add_tail (&data->node, &cfa779_devices);
+    mutex_unlock (&cfa779_devices_lock);
+    return 0;
+fail2:
+    ida_remove (&cfa779_ida, data->id);
+fail1:
+    vfree (data->frame);
+    data->frame = NULL;
+    return err;
+}
+
+/* files still open (or mapped) keep data and the frame until they are
+closed, but from here on they only get -ENODEV */
+static void
+cfa779_unregister_chardev (struct cfa779_data *data)
+{
+    mutex_lock (&cfa779_devices_lock);
+    list_del (&data->node);
+    mutex_unlock (&cfa779_devices_lock);
+    misc_deregister (&data->miscdev);
+
+    down_write (&data->gone_sem);
+    data->gone = true;
+    up_write (&data->gone_sem);
+    cancel_delayed_work_sync (&data->flush_work);
+    ida_remove (&cfa779_ida, data->id);
+}
+
+/* the last reference to data is gone: the client's or an open file's */
+static void
+cfa779_release (struct kref *kref)
+{
+    struct cfa779_data *data = container_of (kref, struct cfa779_data, kref);
 
-    lcd_send_packet (client, 9, 0, NULL);
-    i = lcd_check_reply (client, 9, -1, tb);
+    if (data->frame)
+      {
+          vmalloc_to_page (data->frame)->mapping = NULL;
+          vfree (data->frame);
+      }
+    kfree (data);
+}
 
-    if (i != 14)
-        return 0;
+/* ------------------------------------------------------------ */
+/* debugfs: cfa779/<device>/stats lists the bus counters, writing
+anything to it resets them */
 
-    k = 64;
-    for (j = 1; j < i - 2; j++)
-        k += sprintf (&tb[k], "%u ", tb[j]);
+static int
+cfa779_stats_show (struct seq_file *m, void *v)
+{
+    struct cfa779_data *data = m->private;
+    struct cfa779_stats *st = &data->stats;
+    int i;
 
-    return sprintf (buf, "%s\n", &tb[64]);
+    for (i = 0; i < CFA779_NUM_CODES; i++)
+        seq_printf (m, "sent.%d %lu\n", i, st->sent[i]);
+    seq_printf (m, "sent.other %lu\n", st->sent[CFA779_NUM_CODES]);
+    seq_printf (m, "replies %lu\n", st->replies);
+    seq_printf (m, "no_reply %lu\n", st->no_reply);
+    seq_printf (m, "bad_crc %lu\n", st->bad_crc);
+    seq_printf (m, "bad_len %lu\n", st->bad_len);
+    seq_printf (m, "error_reply %lu\n", st->error_reply);
+    seq_printf (m, "polls %lu\n", st->polls);
+    seq_printf (m, "poll_events %lu\n", st->poll_events);
+    seq_printf (m, "key_resyncs %lu\n", st->key_resyncs);
+    seq_printf (m, "acks %lu\n", st->acks);
+    seq_printf (m, "ack_failed %lu\n", st->ack_failed);
+    seq_printf (m, "retries %lu\n", st->retries);
+    seq_printf (m, "failed %lu\n", st->failed);
+    seq_printf (m, "degraded %lu\n", st->degraded);
+    seq_printf (m, "resyncs %lu\n", st->resyncs);
+    seq_printf (m, "bus_degraded %u\n", data->degraded);
+    seq_printf (m, "idle %u\n", data->idle);
+    seq_printf (m, "queue_depth %u\n", data->queued);
+    seq_printf (m, "queue_max %u\n", data->queue_max);
+    seq_printf (m, "dropped %lu\n", st->dropped);
+    seq_printf (m, "throttled %lu\n", st->throttled);
+    seq_printf (m, "poll_overruns %lu\n", st->poll_overruns);
+    seq_printf (m, "poll_late_max_us %u\n", st->poll_late_max_us);
+    seq_printf (m, "probe_us %u\n", data->probe_us);
+    seq_printf (m, "init_us %u\n", data->init_us);
+    seq_printf (m, "captured %u\n", data->capture_head);
+    /* bucket N counts exchanges of [2^(N-1), 2^N) us */
+    for (i = 0; i < CFA779_LAT_BUCKETS; i++)
+        seq_printf (m, "latency_us.%u %lu\n", i ? 1U << (i - 1) : 0,
+                    st->latency[i]);
+    return 0;
 }
 
-// code 6
-static ssize_t
-cfa779_set_contrast (struct device *dev, struct device_attribute *attr,
-                     const char *buf, size_t count)
+static int
+cfa779_stats_open (struct inode *inode, struct file *file)
 {
-    u8 vbyte;
-    struct i2c_client *client = to_i2c_client (dev);
-    struct cfa779_data *data = i2c_get_clientdata (client);
-    unsigned long val = simple_strtoul (buf, NULL, 10);
-    if (val > CFA779_MAX_CONTRAST)
-        return -EINVAL;
-    vbyte = val;
-    lcd_send_packet (client, 6, 1, &vbyte);
-//if (lcd_check_reply(client,6,0,NULL)!=0) 
-    data->contrast = val;
-    return count;
+    return single_open (file, cfa779_stats_show, inode->i_private);
 }
 
-// code 5
+/* counters are reset without stopping the bus thread, an update racing
+with the reset may survive it */
 static ssize_t
-cfa779_set_cursor_style (struct device *dev, struct device_attribute *attr,
-                         const char *buf, size_t count)
+cfa779_stats_write (struct file *file, const char __user *buf, size_t count,
+                    loff_t *ppos)
 {
-    u8 vbyte;
-    struct i2c_client *client = to_i2c_client (dev);
-    struct cfa779_data *data = i2c_get_clientdata (client);
-    unsigned long val = simple_strtoul (buf, NULL, 10);
-    if (val > CFA779_MAX_CURSOR_STYLE)
-        return -EINVAL;
-    vbyte = val;
-    lcd_send_packet (client, 5, 1, &vbyte);
-//if (lcd_check_reply(client,5,0,NULL)!=0)
-    data->cursor = val;
+    struct seq_file *m = file->private_data;
+    struct cfa779_data *data = m->private;
+
+    memset (&data->stats, 0, sizeof (data->stats));
+    data->xfer_count = 0;
+    data->xfer_time_us = 0;
+    data->xfer_max_us = 0;
     return count;
 }
 
-// code 4
-static ssize_t
-cfa779_set_cursor_pos (struct device *dev, struct device_attribute *attr,
-                       const char *buf, size_t count)
+static const struct file_operations cfa779_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = cfa779_stats_open,
+    .read = seq_read,
+    .write = cfa779_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* debugfs: cfa779/<device>/capture reads the capture ring as struct
+cfa779_capture records, oldest first, as it was when the file was
+opened; writing anything to it empties the ring */
+
+struct cfa779_capture_snap
 {
-    unsigned int x, y;
-    u8 val[2];
-    struct i2c_client *client = to_i2c_client (dev);
+    struct cfa779_data *data;
+    size_t len;
+    struct cfa779_capture rec[0];
+};
 
-    if ((sscanf (buf, "%u %u", &y, &x) != 2) || (x > CFA779_NUM_COLUMNS)
-        || (y >= CFA779_NUM_ROWS))
-        return -EINVAL;
+static int
+cfa779_capture_open (struct inode *inode, struct file *file)
+{
+    struct cfa779_data *data = inode->i_private;
+    struct cfa779_capture_snap *snap;
+    unsigned int i, n, first;
 
-    val[0] = x;
-    val[1] = y;
+    snap = vmalloc (sizeof (*snap) +
+                    data->capture_size * sizeof (snap->rec[0]));
+    if (!snap)
+        return -ENOMEM;
 
-    lcd_send_packet (client, 4, 2, val);
-//lcd_check_reply(client,4,0,NULL);
-    return count;
+    spin_lock (&data->capture_lock);
+    n = min (data->capture_head, data->capture_size);
+    first = data->capture_head - n;
+    for (i = 0; i < n; i++)
+        snap->rec[i] =
+            data->capture_ring[(first + i) & (data->capture_size - 1)];
+    spin_unlock (&data->capture_lock);
+
+    snap->data = data;
+    snap->len = n * sizeof (snap->rec[0]);
+    file->private_data = snap;
+    return 0;
 }
 
-// code 7
 static ssize_t
-cfa779_set_backlight (struct device *dev, struct device_attribute *attr,
-                      const char *buf, size_t count)
+cfa779_capture_read (struct file *file, char __user *buf, size_t count,
+                     loff_t *ppos)
 {
-    u8 vbyte;
-    struct i2c_client *client = to_i2c_client (dev);
-    struct cfa779_data *data = i2c_get_clientdata (client);
-    unsigned long val = simple_strtoul (buf, NULL, 10);
-    if (val > CFA779_MAX_BACKLIGHT)
-        return -EINVAL;
-    vbyte = val;
-    lcd_send_packet (client, 7, 1, &vbyte);
-//if (lcd_check_reply(client,7,0,NULL)!=0) 
-    data->backlight = val;
-    return count;
+    struct cfa779_capture_snap *snap = file->private_data;
+
+    return simple_read_from_buffer (buf, count, ppos, snap->rec, snap->len);
 }
 
 static ssize_t
-cfa779_set_rawcmd (struct device *dev, struct device_attribute *attr,
-                   const char *buf, size_t count)
+cfa779_capture_write (struct file *file, const char __user *buf,
+                      size_t count, loff_t *ppos)
 {
-    char val[16];
-    char tb[256];
-    int i, j, k;
-    struct i2c_client *client = to_i2c_client (dev);
-    size_t mycnt;
-
-    mycnt = count;
-    if (mycnt > 17)
-        mycnt = 17;
-    mycnt--;
-
-    if (mycnt == 0) {
-        lcd_send_packet (client, buf[0], mycnt, NULL);
-    } else {
-        memcpy (val, &buf[1], mycnt);
-        lcd_send_packet (client, buf[0], mycnt, val);
-    }
-    i = lcd_check_reply (client, buf[0], -1, tb);
+    struct cfa779_capture_snap *snap = file->private_data;
 
-    k = 64;
-    for (j = 0; j < i; j++)
-        k += sprintf (&tb[k], "%02X ", tb[j] & 0xFF);
-    printk ("Result(%d): %s\n", i, &tb[64]);
+    spin_lock (&snap->data->capture_lock);
+    snap->data->capture_head = 0;
+    spin_unlock (&snap->data->capture_lock);
     return count;
 }
 
-// code 1
-// code 2
-static ssize_t
-lcd_set_text (struct device *dev, const char *buf, size_t count, u8 line)
+static int
+cfa779_capture_release (struct inode *inode, struct file *file)
 {
-    char val[CFA779_NUM_COLUMNS];
-    struct i2c_client *client = to_i2c_client (dev);
-    size_t mycnt;
+    vfree (file->private_data);
+    return 0;
+}
 
-    memset (val, 0x20, sizeof (val));
-    mycnt = count;
-    if (mycnt > CFA779_NUM_COLUMNS)
-        mycnt = CFA779_NUM_COLUMNS;
-    memcpy (val, buf, mycnt);
-    lcd_send_packet (client, line, 16, val);
-//lcd_check_reply(client,line,0,NULL);
-    return count;
+static const struct file_operations cfa779_capture_fops = {
+    .owner = THIS_MODULE,
+    .open = cfa779_capture_open,
+    .read = cfa779_capture_read,
+    .write = cfa779_capture_write,
+    .llseek = default_llseek,
+    .release = cfa779_capture_release,
+};
+
+static void
+cfa779_debugfs_init (struct cfa779_data *data)
+{
+    if (!cfa779_debugfs_root || IS_ERR (cfa779_debugfs_root))
+        return;
+    data->debugfs = debugfs_create_dir (dev_name (&data->client->dev),
+                                        cfa779_debugfs_root);
+    if (!data->debugfs || IS_ERR (data->debugfs))
+        return;
+    debugfs_create_file ("stats", S_IWUSR | S_IRUGO, data->debugfs, data,
+                         &cfa779_stats_fops);
+    if (data->capture_ring)
+        debugfs_create_file ("capture", S_IWUSR | S_IRUSR, data->debugfs,
+                             data, &cfa779_capture_fops);
 }
 
-static ssize_t
-cfa779_set_line1 (struct device *dev, struct device_attribute *attr,
-                  const char *buf, size_t count)
+static void
+cfa779_debugfs_exit (struct cfa779_data *data)
 {
-    return lcd_set_text (dev, buf, count, 1);
+    if (data->debugfs && !IS_ERR (data->debugfs))
+        debugfs_remove_recursive (data->debugfs);
+    data->debugfs = NULL;
 }
 
-static ssize_t
-cfa779_set_line2 (struct device *dev, struct device_attribute *attr,
-                  const char *buf, size_t count)
+u8 kbd_press[] = {3, 4, 1, 2, 5};
+u8 kbd_release[] = {8, 9, 6, 7, 10};
+
+/* called with keypad_lock held for writing */
+static void cfa779_report_key(struct cfa779_data *data, int key, int value)
 {
-    return lcd_set_text (dev, buf, count, 2);
+    struct cfa779_edge *e = &data->edges[data->nedges++ % CFA779_EDGE_RING];
+
+    trace_cfa779_key(data->client, data->keymap[key], value);
+    input_report_key(data->idev, data->keymap[key], value);
+    if (key < CFA779_NUM_KEYS && value) {
+        data->keys_down |= 1 << key;
+        data->key_down_at[key] = jiffies;
+        data->long_sent &= ~(1 << key);
+    } else if (key < CFA779_NUM_KEYS)
+        data->keys_down &= ~(1 << key);
+
+    e->us = ktime_to_us(data->last_poll);
+    e->keycode = data->keymap[key];
+    e->value = value;
 }
 
-// code 3
-/* defines user character, fyrst byte is character code (0..7),
-other 8 bytes are bitmasks */
-static ssize_t
-cfa779_set_character (struct device *dev, struct device_attribute *attr,
-                      const char *buf, size_t count)
+/* runs on the bus workqueue, so it talks to the device directly;
+returns the number of key edges reported */
+static int cfa779_poll(struct cfa779_data *data)
 {
-    u8 val[9];
-    unsigned int bmp[9];
-    int i;
-    struct i2c_client *client = to_i2c_client (dev);
+    struct input_dev *idev = data->idev;
 
-    if (sscanf (buf, "%u %u %u %u %u %u %u %u %u", &bmp[0], &bmp[1],
-                &bmp[2], &bmp[3], &bmp[4], &bmp[5], &bmp[6], &bmp[7],
-                &bmp[8]) != 9)
-        return -EINVAL;
+    u8 tb[CFA779_REPLY_SIZE];
+    ktime_t prev = data->last_poll;
+    int i, events = 0;
+    u32 us;
 
-    for (i = 0; i < 9; i++)
-        val[i] = bmp[i] & 0xFF;
+    data->last_poll = ktime_get();
+    i = cfa779_exchange_retry(data, 9, 0, NULL, tb);
 
-    lcd_send_packet (client, 3, 9, val);
-//lcd_check_reply(client,3,0,NULL);
-    return count;
-}
+    data->stats.polls++;
+    if (i != 14) return 0;
 
+    /* the reply consumed the edges: publish them and the keypad state
+       for sysfs readers together with reporting them */
+    write_seqlock(&data->keypad_lock);
+    memcpy(data->keypad, &tb[1], CFA779_KEYPAD_SIZE);
+    data->keypad_valid = true;
+    data->keypad_stamp = jiffies;
 
-void
-lcd_send_packet (struct i2c_client *client, u8 idx, int len, char *data)
-{
-    u8 val[24];
-    u16 crc;
-    if (len > 0x10)
-        len = 0x10;
+    for (i = 0; i < CFA779_NUM_KEYS; i++) {
+        if (tb[kbd_press[i]+1]) {
+            cfa779_report_key(data, i, 1);
+            events++;
+        }
 
-    val[0] = idx;
-    memcpy (&val[2], data, len++);
-    val[1] = ++len;
+        if (tb[kbd_release[i]+1]) {
+            cfa779_report_key(data, i, 0);
+            events++;
+        }
+    }
 
-    crc = calc_crc (val, len);
+    /* the edges of a reply that got lost on the bus are gone, the held
+       keys of this one still show a press or release missed that way.
+       Only the emulator is known to report held keys there, on the
+       panel it would release keys that are still down */
+    for (i = 0; i < CFA779_NUM_KEYS && key_resync; i++) {
+        int held = !!(tb[1] & (1 << (kbd_press[i] - 1)));
+
+        if (held != !!(data->keys_down & (1 << i))) {
+            cfa779_report_key(data, i, held);
+            data->stats.key_resyncs++;
+            events++;
+        }
+    }
 
-    val[len] = crc & 0xFF;
-    val[len + 1] = (crc >> 8) & 0xFF;
-    i2c_smbus_write_block_data (client, idx, len, &val[2]);
-}
+    /* keys are polled at poll_min while held, which is the resolution
+       of the hold time; the long press is a tap of the second code and
+       ends the autorepeat of the held key */
+    for (i = 0; i < CFA779_NUM_KEYS && long_press; i++) {
+        if (!(data->keys_down & ~data->long_sent & (1 << i)) ||
+            time_before(jiffies, data->key_down_at[i] +
+                        msecs_to_jiffies(long_press)))
+            continue;
+        data->long_sent |= 1 << i;
+        cfa779_report_key(data, CFA779_NUM_KEYS + i, 1);
+        input_sync(idev);
+        cfa779_report_key(data, CFA779_NUM_KEYS + i, 0);
+        events++;
+    }
+    write_sequnlock(&data->keypad_lock);
+    input_sync(idev);
 
+    if (events) {
+        mutex_lock(&data->update_lock);
+        __cfa779_activity(data);
+        mutex_unlock(&data->update_lock);
+        data->marquee_resume = jiffies + msecs_to_jiffies(marquee_pause);
+        data->stats.poll_events++;
+        us = ktime_us_delta(ktime_get(), prev);
+        data->key_events += events;
+        data->key_latency_us += (u64) us * events;
+        if (us > data->key_latency_max_us)
+            data->key_latency_max_us = us;
+    }
+    return events;
+}
 
-static int
-cfa779_detect (struct i2c_client *new_client, int kind,
-               struct i2c_board_info *info)
+/* polls at poll_min while keys are held and for poll_decay ms after the
+last edge, then doubles the interval on every poll up to poll_interval */
+static unsigned int cfa779_next_interval(struct cfa779_data *data, int events)
 {
-    struct i2c_adapter *adapter = new_client->adapter;
-
-    if (!i2c_check_functionality
-        (adapter, I2C_FUNC_SMBUS_BYTE_DATA | I2C_FUNC_SMBUS_WRITE_WORD_DATA))
-        return -ENODEV;
+    unsigned int fast = max_t(unsigned int, poll_min, POLL_INTERVAL_MIN);
+    unsigned int slow = max_t(unsigned int, poll_interval, fast);
 
-    /*
-     * Now we do the remaining detection. A negative kind means that
-     * the driver was loaded with no force parameter (default), so we
-     * must both detect and identify the chip. A zero kind means that
-     * the driver was loaded with the force parameter, the detection
-     * step shall be skipped. A positive kind means that the driver
-     * was loaded with the force parameter and a given kind of chip is
-     * requested, so both the detection and the identification steps
-     * are skipped.
-     */
+    if (events)
+        data->active_until = jiffies + msecs_to_jiffies(poll_decay);
 
-    if (kind == 0)
-        kind = cfa779;
+    if (data->degraded)
+        return data->cur_interval = max(poll_degraded, slow);
+    if (data->idle)
+        return data->cur_interval = max(poll_idle, slow);
 
-    if (kind < 0)
-      {                         /* detection and identification */
-          lcd_send_packet (new_client, 0, 0, NULL);
-          if (lcd_check_reply (new_client, 0, 0, NULL) == 0)
-              return -ENODEV;
-          kind = cfa779;
-      }
+    if (data->keys_down || time_before(jiffies, data->active_until))
+        data->cur_interval = fast;
+    else
+        data->cur_interval = clamp_t(unsigned int, data->cur_interval * 2,
+                                     fast, slow);
+    return data->cur_interval;
+}
 
-    strncpy (info->type, "cfa779", I2C_NAME_SIZE);
+static void cfa779_keypad_work(struct work_struct *work)
+{
+    struct cfa779_data *data =
+        container_of(work, struct cfa779_data, keypad_work);
 
-    return 0;
+    cfa779_poll(data);
 }
 
-static struct cfa779_data cdata = {
-    .keymap = {
-        [0] = KEY_UP,
-        [1] = KEY_DOWN,
-        [2] = KEY_LEFT,
-        [3] = KEY_RIGHT,
-        [4] = KEY_ENTER,
-    },
-};
-
-u8 kbd_press[] = {3, 4, 1, 2, 5};
-u8 kbd_release[] = {8, 9, 6, 7, 10};
+static void cfa779_queue_poll(struct cfa779_data *data, unsigned int ms)
+{
+    data->poll_due = ktime_add_us(ktime_get(), (u64)ms * USEC_PER_MSEC);
+    queue_delayed_work(data->wq, &data->poll_work, msecs_to_jiffies(ms));
+}
 
-static void cfa779_poll(struct input_polled_dev *ipdev)
+static void cfa779_poll_work(struct work_struct *work)
 {
-    struct cfa779_data *data = ipdev->private;
-    struct input_dev *idev = ipdev->input;
+    struct cfa779_data *data =
+        container_of(work, struct cfa779_data, poll_work.work);
+    s64 late = ktime_us_delta(ktime_get(), data->poll_due);
+    int events;
+
+    if (late > data->stats.poll_late_max_us)
+        data->stats.poll_late_max_us = late;
+    if (late > (s64)poll_budget * USEC_PER_MSEC)
+        data->stats.poll_overruns++;
+
+    events = cfa779_poll(data);
+    cfa779_queue_poll(data, cfa779_next_interval(data, events));
+}
 
-    u8 tb[256];
-    int i;
+/* the keypad is only polled while somebody has the input device open */
+static int cfa779_input_open(struct input_dev *idev)
+{
+    struct cfa779_data *data = input_get_drvdata(idev);
 
-    lcd_send_packet(data->client, 9, 0, NULL);
-    i = lcd_check_reply(data->client, 9, -1, tb);
+    data->cur_interval = poll_interval;
+    data->active_until = jiffies;
+    data->last_poll = ktime_get();
+    cfa779_queue_poll(data, 0);
+    return 0;
+}
 
-    if (i != 14) return;
+static void cfa779_input_close(struct input_dev *idev)
+{
+    struct cfa779_data *data = input_get_drvdata(idev);
+    int i;
 
-    for (i = 0; i < idev->keycodemax; i++) {
-        if (tb[kbd_press[i]+1]) {
-            printk("Pressed %d\n", data->keymap[i]);
-            input_report_key(idev, data->keymap[i], 1);
-        }
+    cancel_delayed_work_sync(&data->poll_work);
 
-        if (tb[kbd_release[i]+1]) {
-            printk("Released %d\n", data->keymap[i]);
-            input_report_key(idev, data->keymap[i], 0);
-        }
-    }
+    /* nothing polls for their release now, so keys still held would
+       autorepeat until the next open */
+    write_seqlock(&data->keypad_lock);
+    for (i = 0; i < CFA779_NUM_KEYS; i++)
+        if (data->keys_down & (1 << i))
+            cfa779_report_key(data, i, 0);
+    write_sequnlock(&data->keypad_lock);
     input_sync(idev);
 }
 
@@ -583,12 +2813,60 @@ static int cfa779_register_sysfs(struct i2c_client *client)
         goto fail8;
     if ((err = device_create_file (dev, &dev_attr_cursor_position)))
         goto fail9;
+    if ((err = device_create_file (dev, &dev_attr_elided)))
+        goto fail10;
+    if ((err = device_create_file (dev, &dev_attr_transport)))
+        goto fail11;
+    if ((err = device_create_file (dev, &dev_attr_latency)))
+        goto fail12;
+    if ((err = device_create_file (dev, &dev_attr_key_latency)))
+        goto fail13;
+    if ((err = device_create_file (dev, &dev_attr_keypad_events)))
+        goto fail14;
+    if ((err = device_create_file (dev, &dev_attr_refresh_version)))
+        goto fail15;
+    if ((err = device_create_file (dev, &dev_attr_ack_mode)))
+        goto fail16;
+    if ((err = device_create_file (dev, &dev_attr_queue)))
+        goto fail17;
+    if ((err = device_create_bin_file (dev, &bin_attr_screen)))
+        goto fail18;
+    if ((err = device_create_file (dev, &dev_attr_bargraph)))
+        goto fail19;
+    if ((err = device_create_file (dev, &dev_attr_marquee1)))
+        goto fail20;
+    if ((err = device_create_file (dev, &dev_attr_marquee2)))
+        goto fail21;
 
     if (rawcmd != 0)
         if ((err = device_create_file (dev, &dev_attr_rawcmd)))
-            goto fail10;
+            goto fail22;
 
     return 0;
+fail22:
+    device_remove_file (dev, &dev_attr_marquee2);
+fail21:
+    device_remove_file (dev, &dev_attr_marquee1);
+fail20:
+    device_remove_file (dev, &dev_attr_bargraph);
+fail19:
+    device_remove_bin_file (dev, &bin_attr_screen);
+fail18:
+    device_remove_file (dev, &dev_attr_queue);
+fail17:
+    device_remove_file (dev, &dev_attr_ack_mode);
+fail16:
+    device_remove_file (dev, &dev_attr_refresh_version);
+fail15:
+    device_remove_file (dev, &dev_attr_keypad_events);
+fail14:
+    device_remove_file (dev, &dev_attr_key_latency);
+fail13:
+    device_remove_file (dev, &dev_attr_latency);
+fail12:
+    device_remove_file (dev, &dev_attr_transport);
+fail11:
+    device_remove_file (dev, &dev_attr_elided);
 fail10:
     device_remove_file (dev, &dev_attr_cursor_position);
 fail9:
@@ -617,6 +2895,18 @@ static void cfa779_unregister_sysfs(struct i2c_client *client)
 
     if (rawcmd != 0) 
         device_remove_file (dev, &dev_attr_rawcmd);
+    device_remove_file (dev, &dev_attr_marquee2);
+    device_remove_file (dev, &dev_attr_marquee1);
+    device_remove_file (dev, &dev_attr_bargraph);
+    device_remove_bin_file (dev, &bin_attr_screen);
+    device_remove_file (dev, &dev_attr_queue);
+    device_remove_file (dev, &dev_attr_ack_mode);
+    device_remove_file (dev, &dev_attr_refresh_version);
+    device_remove_file (dev, &dev_attr_keypad_events);
+    device_remove_file (dev, &dev_attr_key_latency);
+    device_remove_file (dev, &dev_attr_latency);
+    device_remove_file (dev, &dev_attr_transport);
+    device_remove_file (dev, &dev_attr_elided);
     device_remove_file (dev, &dev_attr_cursor_position);
     device_remove_file (dev, &dev_attr_cursor_style);
     device_remove_file (dev, &dev_attr_user_character);
@@ -629,17 +2919,62 @@ static void cfa779_unregister_sysfs(struct i2c_client *client)
 }
 
 
+/* Display I/O of probe, done on the bus thread so that probe itself
+   only registers the device. Must not use cfa779_xfer(). */
+static void cfa779_init_work(struct work_struct *work)
+{
+    struct cfa779_data *data =
+        container_of(work, struct cfa779_data, init_work);
+    struct i2c_client *client = data->client;
+    char buf[CFA779_NUM_COLUMNS + 1];
+    char version[CFA779_VERSION_LEN];
+    u8 tb[CFA779_REPLY_SIZE];
+    ktime_t start = ktime_get();
+    u8 fresh;
+    size_t n;
+    s32 b;
+
+    b = i2c_smbus_read_byte_data(client, 0x20);
+    pr_debug("cfa779: LCD Type = 0x%02X\n", b);
+
+    /*??? Reset the cfa779 chip */
+    i2c_smbus_write_byte_data(client, 0, 1);
+
+    lcd_parse_version(tb, cfa779_exchange_retry(data, 8, 0, NULL, tb),
+                      version, sizeof(version) - 1);
+
+    /* rows written since probe returned are not splashed over; the
+       lock is held until the splash is posted so none can slip in */
+    mutex_lock(&data->update_lock);
+    memcpy(data->version, version, sizeof(data->version));
+    fresh = ~data->shadow_valid;
+    if (fresh & 1) {
+        memset(buf, 0x20, CFA779_NUM_COLUMNS);
+        memcpy(buf, "cfa779 driver OK", 16);
+        __lcd_write_row(data, 0, buf);
+    }
+    if (fresh & 2) {
+        snprintf(buf, sizeof(buf), "LCD %s", version);
+        n = strlen(buf);
+        memset(buf + n, 0x20, CFA779_NUM_COLUMNS - n);
+        __lcd_write_row(data, 1, buf);
+    }
+    mutex_unlock(&data->update_lock);
+
+    data->init_us = ktime_to_us(ktime_sub(ktime_get(), start));
+    dev_info(&client->dev, "display initialised in %u us\n",
+             data->init_us);
+}
+
 /* This function is called by i2c_probe */
 static int
 cfa779_probe (struct i2c_client *client, const struct i2c_device_id *id)
 {
-    struct cfa779_data *data = &cdata;
-    s32 b;
+    struct cfa779_data *data;
+    ktime_t start = ktime_get();
     int err = 0;
     int i;
-    struct input_polled_dev *ipdev;
     struct input_dev *idev;
-    char buf[CFA779_NUM_COLUMNS + 1];
 
     struct device *dev = &client->dev;
 
@@ -647,71 +2982,166 @@ cfa779_probe (struct i2c_client *client, const struct i2c_device_id *id)
                                   I2C_FUNC_SMBUS_WRITE_WORD_DATA))
         return -ENODEV;
 
+    /* not devm: open /dev/cfa779N files may outlive the client */
+    data = kzalloc (sizeof (*data), GFP_KERNEL);
+    if (!data)
+        return -ENOMEM;
+    kref_init (&data->kref);
+
     data->client = client;
     i2c_set_clientdata (client, data);
-
-    b = i2c_smbus_read_byte_data (client, 0x20);
-    pr_debug("cfa779: LCD Type = 0x%02X\n", b);
+    memcpy (data->keymap, cfa779_keymap, sizeof (data->keymap));
 
     strncpy (client->name, "cfa779", I2C_NAME_SIZE);
 
     data->backlight = CFA779_INIT;
     data->contrast = CFA779_INIT;
     data->cursor = CFA779_INIT;
+    data->cursor_row = CFA779_INIT;
+    data->cursor_col = CFA779_INIT;
+    data->shadow_valid = 0;
+    data->elided = 0;
+    data->cgram_valid = 0;
+    data->cgram_clock = 0;
+    data->marquee_active = 0;
+    data->marquee_resume = jiffies;
+    INIT_DELAYED_WORK (&data->marquee_work, cfa779_marquee_work);
+    data->last_activity = jiffies;
+    data->idle = false;
+    INIT_DELAYED_WORK (&data->idle_work, cfa779_idle_work);
+    INIT_DELAYED_WORK (&data->flush_work, cfa779_flush_work);
+    data->ack_mode = CFA779_ACK_NONE;
+    data->failures = 0;
+    data->degraded = false;
+    data->ack_mask = 0;
+    data->ack_count = 0;
+    mutex_init (&data->update_lock);
+
+    data->use_i2c = !force_smbus &&
+        i2c_check_functionality (client->adapter, I2C_FUNC_I2C);
+    data->xfer_count = 0;
+    data->xfer_time_us = 0;
+    data->xfer_max_us = 0;
+    data->keys_down = 0;
+    data->key_events = 0;
+    data->key_latency_us = 0;
+    data->key_latency_max_us = 0;
+    data->long_sent = 0;
+    memset (&data->stats, 0, sizeof (data->stats));
+    dev_info (dev, "using %s request/reply transfers\n",
+              data->use_i2c ? "combined I2C" : "SMBus block");
+
+    /* before the bus thread starts, so init_work is captured as well */
+    spin_lock_init (&data->capture_lock);
+    data->capture_head = 0;
+    data->capture_size = capture ?
+        roundup_pow_of_two (min_t (unsigned int, capture,
+                                         CFA779_CAPTURE_MAX)) : 0;
+    data->capture_ring = NULL;
+    if (data->capture_size)
+      {
+          data->capture_ring = vmalloc (data->capture_size *
+                                        sizeof (*data->capture_ring));
+          if (!data->capture_ring)
+            {
+                err = -ENOMEM;
+                goto exit_capture;
+            }
+      }
 
-    ipdev = input_allocate_polled_device();
-    if (!ipdev)
-        return -ENOMEM;
+    err = cfa779_init_queue (data);
+    if (err)
+        goto exit_capture;
+
+    /* the first thing on the bus thread, anything queued from here on
+       finds the display reset */
+    INIT_WORK (&data->init_work, cfa779_init_work);
+    queue_work (data->wq, &data->init_work);
 
-    data->ipdev = ipdev;
+    INIT_DELAYED_WORK(&data->poll_work, cfa779_poll_work);
+    INIT_WORK(&data->keypad_work, cfa779_keypad_work);
+    seqlock_init(&data->keypad_lock);
+
+    idev = input_allocate_device();
+    if (!idev) {
+        err = -ENOMEM;
+        goto exit_queue;
+    }
 
-    ipdev->poll = cfa779_poll;
-    ipdev->poll_interval = POLL_INTERVAL_DEFAULT;
-    ipdev->private = data;
+    data->idev = idev;
+    input_set_drvdata(idev, data);
 
-    idev = ipdev->input;
+    idev->open = cfa779_input_open;
+    idev->close = cfa779_input_close;
     idev->name = "cfa779 buttons";
-    idev->phys = "cfa779/input0";
+    snprintf(data->phys, sizeof(data->phys), "%s/input0", dev_name(dev));
+    idev->phys = data->phys;
     idev->id.bustype = BUS_HOST;
     idev->dev.parent = &client->dev;
 
     set_bit(EV_KEY, idev->evbit);
+    set_bit(EV_REP, idev->evbit);
 
     idev->keycode = data->keymap;
     idev->keycodesize = sizeof(data->keymap[0]);
-    idev->keycodemax = 5;
+    idev->keycodemax = CFA779_NUM_KEYCODES;
 
     for (i = 0; i < idev->keycodemax; i++)
         if (data->keymap[i]) {
             set_bit(data->keymap[i], idev->keybit);
         }
 
-    err = input_register_polled_device(ipdev);
+    err = input_register_device(idev);
     if (err) goto exit_free;
 
+    /* only now: the input layer does software autorepeat only for
+       devices registered with no repeat rates set */
+    if (repeat_delay)
+        idev->rep[REP_DELAY] = repeat_delay;
+    if (repeat_period)
+        idev->rep[REP_PERIOD] = repeat_period;
+
     err = cfa779_register_sysfs(client);
     if (err) {
         dev_err(&client->dev, "cfa779 registering sysfs failed \n");
         goto exit_unregister;
     }
 
+    err = cfa779_register_chardev(data);
+    if (err) {
+        dev_err(&client->dev, "cfa779 registering char device failed \n");
+        goto exit_sysfs;
+    }
 
-    /*??? Reset the cfa779 chip */
-    i2c_smbus_write_byte_data (client, 0, 1);
-
-    lcd_set_text (dev, "cfa779 driver OK", 16, 1);
+    cfa779_debugfs_init(data);
 
-    sprintf (buf, "LCD ");
-    lcd_get_version (client, &buf[4], CFA779_NUM_COLUMNS - 4);
+    if (idle_timeout)
+        schedule_delayed_work(&data->idle_work,
+                              msecs_to_jiffies(idle_timeout * 1000));
 
-    lcd_set_text (dev, buf, strlen (buf), 2);
+    data->probe_us = ktime_to_us(ktime_sub(ktime_get(), start));
+    dev_info(dev, "probed in %u us\n", data->probe_us);
 
     return 0;
 
+  exit_sysfs:
+    cfa779_unregister_sysfs(client);
   exit_unregister:
-    input_unregister_polled_device(ipdev);
+    input_unregister_device(idev);
+    goto exit_queue;
   exit_free:
-    input_free_polled_device(ipdev);
+    input_free_device(idev);
+  exit_queue:
+    /* sysfs writes and init_work may have armed these, and they run
+       after data is gone otherwise */
+    flush_work(&data->init_work);
+    cancel_delayed_work_sync(&data->idle_work);
+    cancel_delayed_work_sync(&data->flush_work);
+    cancel_delayed_work_sync(&data->marquee_work);
+    cfa779_destroy_queue(data);
+  exit_capture:
+    vfree(data->capture_ring);
+    kref_put(&data->kref, cfa779_release);
     return err;
 }
 
@@ -720,14 +3150,77 @@ cfa779_remove (struct i2c_client *client)
 {
     struct cfa779_data *data = i2c_get_clientdata(client);
 
+    cfa779_debugfs_exit(data);
+    cfa779_unregister_chardev(data);
     cfa779_unregister_sysfs(client);
+    cancel_delayed_work_sync(&data->marquee_work);
 
-    input_unregister_polled_device(data->ipdev);
-    input_free_polled_device(data->ipdev);
+    input_unregister_device(data->idev);
 
     lcd_set_text (&client->dev, "Shutdown", 8, 1);
     lcd_set_text (&client->dev, "Finished", 8, 2);
 
+    /* only now: the goodbye text is activity and arms it again */
+    cancel_delayed_work_sync(&data->idle_work);
+    cfa779_destroy_queue(data);
+    vfree(data->capture_ring);
+    i2c_set_clientdata(client, NULL);
+    kref_put(&data->kref, cfa779_release);
+
+    return 0;
+}
+
+/* the bus thread is not freezable: hold back the command queue, stop
+everything that would start bus traffic on its own and wait for the bus
+thread to finish what it is doing. Commands posted from here on stay
+queued until resume. */
+static int
+cfa779_suspend (struct i2c_client *client, pm_message_t mesg)
+{
+    struct cfa779_data *data = i2c_get_clientdata(client);
+
+    spin_lock(&data->cmd_lock);
+    data->suspended = true;
+    spin_unlock(&data->cmd_lock);
+
+    cancel_delayed_work_sync(&data->idle_work);
+    cancel_delayed_work_sync(&data->marquee_work);
+    data->flush_pending = cancel_delayed_work_sync(&data->flush_work);
+    cancel_delayed_work_sync(&data->poll_work);
+    flush_workqueue(data->wq);
+    /* a cmd_work that ran before the flag was seen may have armed it */
+    cancel_delayed_work_sync(&data->throttle_work);
+    return 0;
+}
+
+/* the panel may have lost power: resend everything it should show */
+static int
+cfa779_resume (struct i2c_client *client)
+{
+    struct cfa779_data *data = i2c_get_clientdata(client);
+
+    spin_lock(&data->cmd_lock);
+    data->suspended = false;
+    spin_unlock(&data->cmd_lock);
+
+    mutex_lock(&data->update_lock);
+    __cfa779_activity(data);
+    mutex_unlock(&data->update_lock);
+    cfa779_resync(data);
+    queue_work(data->wq, &data->cmd_work);
+    /* for frame changes whose flush was cancelled by suspend; without
+       one the frame may be stale and must not replace the resynced rows */
+    if (data->flush_pending)
+        schedule_delayed_work(&data->flush_work, 0);
+    data->flush_pending = false;
+
+    if (data->marquee_active)
+        schedule_delayed_work(&data->marquee_work,
+                              msecs_to_jiffies(max(marquee_speed, 50U)));
+    mutex_lock(&data->idev->mutex);
+    if (data->idev->users)
+        cfa779_queue_poll(data, 0);
+    mutex_unlock(&data->idev->mutex);
     return 0;
 }
 
@@ -737,13 +3230,21 @@ cfa779_remove (struct i2c_client *client)
 static int __init
 cfa779_init (void)
 {
-    return i2c_add_driver (&cfa779_driver);
+    int err;
+
+    cfa779_debugfs_root = debugfs_create_dir ("cfa779", NULL);
+    err = i2c_add_driver (&cfa779_driver);
+    if (err && cfa779_debugfs_root && !IS_ERR (cfa779_debugfs_root))
+        debugfs_remove (cfa779_debugfs_root);
+    return err;
 }
 
 static void __exit
 cfa779_exit (void)
 {
     i2c_del_driver (&cfa779_driver);
+    if (cfa779_debugfs_root && !IS_ERR (cfa779_debugfs_root))
+        debugfs_remove (cfa779_debugfs_root);
 }
 
 module_init (cfa779_init);
@@ -0,0 +1,67 @@
+/*
+    cfa779.h - userspace interface of the CrystalFontz CFA-779 driver
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+*/
+
+#ifndef _CFA779_H
+#define _CFA779_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define CFA779_MAX_PAYLOAD  16  /* max packet payload */
+
+/* reply verdicts, as reported by the cfa779_reply event and in
+   struct cfa779_raw.status */
+#define CFA779_REPLY_OK     0
+#define CFA779_REPLY_NONE   1   /* no or short reply */
+#define CFA779_REPLY_BADCRC 2
+#define CFA779_REPLY_BADLEN 3   /* unexpected length */
+#define CFA779_REPLY_ERROR  4   /* device flagged the command as failed */
+
+/* one raw command and its reply */
+struct cfa779_raw
+{
+    __u8 code;
+    __u8 len;                   /* payload bytes, up to CFA779_MAX_PAYLOAD */
+    __u8 status;                /* out: CFA779_REPLY_* */
+    __u8 reply_len;             /* out: reply bytes, 0 if none */
+    __u8 data[CFA779_MAX_PAYLOAD];
+    __u8 reply[32];             /* out: reply code, data and crc */
+};
+
+#define CFA779_RAW_BATCH_MAX 256
+
+/* commands are sent in order; done tells how many were, also when the
+   ioctl fails part way */
+struct cfa779_raw_batch
+{
+    __u64 cmds;                 /* struct cfa779_raw[count] */
+    __u32 count;
+    __u32 done;                 /* out */
+};
+
+/* records of debugfs cfa779/<device>/capture, with the module loaded
+   with capture=N: the last N packets sent and reply blocks read back */
+#define CFA779_CAP_SEND     0   /* data: code, count, payload, crc */
+#define CFA779_CAP_REPLY    1   /* data: status, reply data, crc */
+
+struct cfa779_capture
+{
+    __u64 ns;                   /* monotonic clock */
+    __u8 dir;                   /* CFA779_CAP_* */
+    __u8 code;                  /* command code */
+    __u8 status;                /* replies: CFA779_REPLY_* */
+    __u8 len;                   /* bytes on the wire, data keeps 20 */
+    __u8 data[20];
+};
+
+/* on /dev/cfa779N, needs the module loaded with rawcmd=1 */
+#define CFA779_IOC_MAGIC    0xC7
+#define CFA779_IOC_RAW      _IOWR(CFA779_IOC_MAGIC, 1, struct cfa779_raw_batch)
+
+#endif /* _CFA779_H */
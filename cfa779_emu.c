@@ -0,0 +1,591 @@
+/*
+    cfa779_emu.c - software CrystalFontz CFA-779 on a virtual i2c adapter
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+    Registers i2c adapters with an emulated CFA-779 at address 0x20, so
+    cfa779.ko can be loaded, probed and exercised without the hardware.
+    The adapters are in I2C_CLASS_HWMON, the driver finds the display
+    through its usual detection, unless loaded with detect=0.
+
+    debugfs cfa779-emu/<adapter>/ has:
+      screen  - read: the two rows, cursor, contrast, backlight and
+                user characters as the device would show them
+      keypad  - write "press <key>", "release <key>" or "tap <key>",
+                key is one of up, down, left, right, enter
+      faults  - read: faults injected so far, write: reset the counts
+
+    The *_rate options inject faults into that many of every 1000 reply
+    reads (transactions for delay_rate); they can be changed at any time
+    through /sys/module/cfa779_emu/parameters.
+*/
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/i2c.h>
+#include <linux/mutex.h>
+#include <linux/delay.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/random.h>
+
+#include <asm/uaccess.h>
+
+#include <linux/crc-ccitt.h>
+
+#define EMU_ADDR            0x20        /* where the CFA-779 answers */
+#define EMU_TYPE            0x79        /* byte read from register 0x20 */
+#define EMU_NUM_COLUMNS     16
+#define EMU_NUM_ROWS        2
+#define EMU_NUM_KEYS        5
+#define EMU_NUM_CHARS       8
+#define EMU_VERSION         "CFA779:emu 1.0"
+
+/* injected faults */
+#define EMU_FAULT_DROP      0   /* reply read back empty */
+#define EMU_FAULT_CRC       1   /* a bit of the crc flipped */
+#define EMU_FAULT_TRUNC     2   /* reply cut short */
+#define EMU_FAULT_DELAY     3   /* transaction takes delay_us longer */
+#define EMU_NUM_FAULTS      4
+
+/* insmod options */
+static unsigned int devices = 1;
+static unsigned int smbus_only = 0;
+static unsigned int latency_us = 0;
+static unsigned int detect = 1;
+static unsigned int drop_rate = 0;
+static unsigned int crc_rate = 0;
+static unsigned int trunc_rate = 0;
+static unsigned int delay_rate = 0;
+static unsigned int delay_us = 0;
+
+module_param (devices, uint, 0);
+MODULE_PARM_DESC (devices, "number of emulated adapters, one display each");
+module_param (smbus_only, uint, 0);
+MODULE_PARM_DESC (smbus_only, "do not advertise plain I2C transfers");
+module_param (latency_us, uint, 0644);
+MODULE_PARM_DESC (latency_us, "time each bus transaction takes, in us");
+module_param (detect, uint, 0);
+MODULE_PARM_DESC (detect, "let cfa779.ko detect the displays; 0 leaves them "
+                  "to /dev/i2c-N, e.g. for cfa779-replay");
+module_param (drop_rate, uint, 0644);
+MODULE_PARM_DESC (drop_rate, "replies per 1000 that are lost");
+module_param (crc_rate, uint, 0644);
+MODULE_PARM_DESC (crc_rate, "replies per 1000 with a corrupted crc");
+module_param (trunc_rate, uint, 0644);
+MODULE_PARM_DESC (trunc_rate, "replies per 1000 that are cut short");
+module_param (delay_rate, uint, 0644);
+MODULE_PARM_DESC (delay_rate, "transactions per 1000 that take delay_us "
+                  "longer");
+module_param (delay_us, uint, 0644);
+MODULE_PARM_DESC (delay_us, "latency added by delay_rate, in us");
+
+MODULE_DESCRIPTION ("CrystalFontz CFA779 emulator");
+MODULE_LICENSE ("GPL");
+
+/* One emulated adapter with its display */
+struct cfa779_emu
+{
+    struct i2c_adapter adapter;
+    struct mutex lock;          /* Protects the device state below */
+    char text[EMU_NUM_ROWS][EMU_NUM_COLUMNS];
+    u8 cgram[EMU_NUM_CHARS][8];
+    u8 cursor_col;
+    u8 cursor_row;
+    u8 cursor_style;
+    u8 contrast;
+    u8 backlight;
+    u8 keys;                    /* Keys held, bit h-1 for hardware key h */
+    u8 pressed;                 /* Edges latched until the next code 9 */
+    u8 released;
+    u8 reply[I2C_SMBUS_BLOCK_MAX];      /* Reply to the last command */
+    int reply_len;
+    unsigned long faults[EMU_NUM_FAULTS];       /* Injected so far */
+    struct dentry *debugfs;
+};
+
+static struct cfa779_emu *emus;
+static struct dentry *emu_debugfs_root;
+
+/* hardware key numbers, as in the code 9 reply */
+static const struct
+{
+    const char *name;
+    u8 hw;
+} emu_keys[EMU_NUM_KEYS] = {
+    {"left", 1},
+    {"right", 2},
+    {"up", 3},
+    {"down", 4},
+    {"enter", 5},
+};
+
+static u16
+calc_crc (u8 * data, int len)
+{
+    return ~crc_ccitt (0xFFFF, data, len);
+}
+
+static void
+emu_delay (unsigned int us)
+{
+    if (us >= 1000)
+        msleep (us / 1000);
+    if (us % 1000)
+        udelay (us % 1000);
+}
+
+/* builds the reply block: status code, data, crc over the block length
+and everything before the crc */
+static void
+emu_set_reply (struct cfa779_emu *emu, u8 status, const u8 * data, int len)
+{
+    u8 tb[I2C_SMBUS_BLOCK_MAX + 1];
+    u16 crc;
+
+    if (len > I2C_SMBUS_BLOCK_MAX - 3)
+        len = I2C_SMBUS_BLOCK_MAX - 3;
+    tb[0] = len + 3;
+    tb[1] = status;
+    memcpy (&tb[2], data, len);
+    crc = calc_crc (tb, len + 2);
+    tb[len + 2] = crc & 0xFF;
+    tb[len + 3] = (crc >> 8) & 0xFF;
+
+    memcpy (emu->reply, &tb[1], len + 3);
+    emu->reply_len = len + 3;
+}
+
+/* executes one packet: code, byte count, payload, crc */
+static void
+emu_command (struct cfa779_emu *emu, const u8 * buf, int len)
+{
+    u8 code = buf[0];
+    int plen = buf[1] - 2;
+    const u8 *p = &buf[2];
+    u8 tb[EMU_NUM_KEYS * 2 + 1];
+    u16 crc;
+    int i;
+
+    if (plen < 0 || buf[1] + 2 != len)
+      {
+          emu_set_reply (emu, 0x80 | code, NULL, 0);
+          return;
+      }
+    crc = calc_crc ((u8 *) buf, plen + 2);
+    if (p[plen] != (crc & 0xFF) || p[plen + 1] != ((crc >> 8) & 0xFF))
+      {
+          emu_set_reply (emu, 0x80 | code, NULL, 0);
+          return;
+      }
+
+    switch (code)
+      {
+      case 0:                  /* ping */
+          emu_set_reply (emu, 0x40 | code, p, plen);
+          return;
+      case 1:                  /* line 1 */
+      case 2:                  /* line 2 */
+          if (plen != EMU_NUM_COLUMNS)
+              break;
+          memcpy (emu->text[code - 1], p, EMU_NUM_COLUMNS);
+          emu_set_reply (emu, 0x40 | code, NULL, 0);
+          return;
+      case 3:                  /* user character */
+          if (plen != 9 || p[0] >= EMU_NUM_CHARS)
+              break;
+          memcpy (emu->cgram[p[0]], &p[1], 8);
+          emu_set_reply (emu, 0x40 | code, NULL, 0);
+          return;
+      case 4:                  /* cursor position: column, row */
+          if (plen != 2 || p[0] > EMU_NUM_COLUMNS || p[1] >= EMU_NUM_ROWS)
+              break;
+          emu->cursor_col = p[0];
+          emu->cursor_row = p[1];
+          emu_set_reply (emu, 0x40 | code, NULL, 0);
+          return;
+      case 5:                  /* cursor style */
+          if (plen != 1 || p[0] > 3)
+              break;
+          emu->cursor_style = p[0];
+          emu_set_reply (emu, 0x40 | code, NULL, 0);
+          return;
+      case 6:                  /* contrast */
+          if (plen != 1 || p[0] > 200)
+              break;
+          emu->contrast = p[0];
+          emu_set_reply (emu, 0x40 | code, NULL, 0);
+          return;
+      case 7:                  /* backlight */
+          if (plen != 1 || p[0] > 100)
+              break;
+          emu->backlight = p[0];
+          emu_set_reply (emu, 0x40 | code, NULL, 0);
+          return;
+      case 8:                  /* version, NUL included */
+          emu_set_reply (emu, 0x40 | code, EMU_VERSION,
+                         sizeof (EMU_VERSION));
+          return;
+      case 9:                  /* keypad: state, press and release edges */
+          tb[0] = emu->keys;
+          for (i = 0; i < EMU_NUM_KEYS; i++)
+            {
+                tb[1 + i] = (emu->pressed >> i) & 1;
+                tb[1 + EMU_NUM_KEYS + i] = (emu->released >> i) & 1;
+            }
+          emu->pressed = 0;
+          emu->released = 0;
+          emu_set_reply (emu, 0x40 | code, tb, sizeof (tb));
+          return;
+      }
+    emu_set_reply (emu, 0x80 | code, NULL, 0);
+}
+
+/* true for rate of every 1000 calls, counting the fault */
+static int
+emu_fault (struct cfa779_emu *emu, unsigned int rate, int fault)
+{
+    if (!rate || random32 () % 1000 >= rate)
+        return 0;
+    emu->faults[fault]++;
+    return 1;
+}
+
+/* copies the pending reply into a RECV_LEN read, damaged as the fault
+rates say. The command has been executed either way, so a lost keypad
+reply loses its key edges, as it would on a noisy bus. */
+static void
+emu_read_reply (struct cfa779_emu *emu, struct i2c_msg *msg)
+{
+    int len = emu->reply_len;
+
+    memcpy (&msg->buf[1], emu->reply, len);
+    if (len < 3)
+        ;                       /* no command yet */
+    else if (emu_fault (emu, drop_rate, EMU_FAULT_DROP))
+        len = 0;
+    else if (emu_fault (emu, trunc_rate, EMU_FAULT_TRUNC))
+        len = random32 () % len;
+    else if (emu_fault (emu, crc_rate, EMU_FAULT_CRC))
+        msg->buf[len - random32 () % 2] ^= 1 << (random32 () % 8);
+    msg->buf[0] = len;
+    msg->len = len + 1;
+}
+
+/* Handles the message sequences the driver and i2c-core produce:
+    [reg, val]                  byte data write, reg 0 resets
+    [code, count, data, crc]    packet, as an SMBus block write
+    [code] + RECV_LEN read      SMBus block read of the last reply
+    [reg] + 1 byte read         byte data read, reg 0x20 is the type
+    packet + RECV_LEN read      combined request/reply transfer
+    empty write                 quick command used by detection */
+static int
+emu_xfer (struct i2c_adapter *adap, struct i2c_msg *msgs, int num)
+{
+    struct cfa779_emu *emu = i2c_get_adapdata (adap);
+    struct i2c_msg *wr = &msgs[0];
+    struct i2c_msg *rd = num > 1 ? &msgs[1] : NULL;
+    int ret = num;
+
+    if (num < 1 || num > 2 || wr->addr != EMU_ADDR || (wr->flags & I2C_M_RD)
+        || (rd && !(rd->flags & I2C_M_RD)))
+        return -ENXIO;
+
+    /* i2c-core runs one transfer per adapter at a time, the fault
+       count needs no lock */
+    emu_delay (latency_us);
+    if (emu_fault (emu, delay_rate, EMU_FAULT_DELAY))
+        emu_delay (delay_us);
+    mutex_lock (&emu->lock);
+    if (wr->len == 2 && !rd)
+      {
+          if (wr->buf[0] == 0)
+            {
+                memset (emu->text, 0x20, sizeof (emu->text));
+                emu->pressed = 0;
+                emu->released = 0;
+            }
+      }
+    else if (wr->len >= 4)
+        emu_command (emu, wr->buf, wr->len);
+
+    if (rd)
+      {
+          if (rd->flags & I2C_M_RECV_LEN)
+              emu_read_reply (emu, rd);
+          else if (rd->len == 1 && wr->len == 1)
+              rd->buf[0] = wr->buf[0] == 0x20 ? EMU_TYPE : 0;
+          else
+              ret = -EIO;
+      }
+    mutex_unlock (&emu->lock);
+    return ret;
+}
+
+static u32
+emu_func (struct i2c_adapter *adap)
+{
+    u32 func = I2C_FUNC_SMBUS_EMUL | I2C_FUNC_SMBUS_READ_BLOCK_DATA;
+
+    if (!smbus_only)
+        func |= I2C_FUNC_I2C;
+    return func;
+}
+
+static const struct i2c_algorithm emu_algo = {
+    .master_xfer = emu_xfer,
+    .functionality = emu_func,
+};
+
+/* ------------------------------------------------------------ */
+
+static int
+emu_screen_show (struct seq_file *m, void *v)
+{
+    struct cfa779_emu *emu = m->private;
+    int i, j;
+
+    mutex_lock (&emu->lock);
+    for (i = 0; i < EMU_NUM_ROWS; i++)
+        seq_printf (m, "|%.*s|\n", EMU_NUM_COLUMNS, emu->text[i]);
+    seq_printf (m, "cursor %u %u style %u\n", emu->cursor_row,
+                emu->cursor_col, emu->cursor_style);
+    seq_printf (m, "contrast %u backlight %u\n", emu->contrast,
+                emu->backlight);
+    for (i = 0; i < EMU_NUM_CHARS; i++)
+      {
+          seq_printf (m, "char %d", i);
+          for (j = 0; j < 8; j++)
+              seq_printf (m, " %u", emu->cgram[i][j]);
+          seq_putc (m, '\n');
+      }
+    mutex_unlock (&emu->lock);
+    return 0;
+}
+
+static int
+emu_screen_open (struct inode *inode, struct file *file)
+{
+    return single_open (file, emu_screen_show, inode->i_private);
+}
+
+static const struct file_operations emu_screen_fops = {
+    .owner = THIS_MODULE,
+    .open = emu_screen_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static const char *emu_fault_names[EMU_NUM_FAULTS] = {
+    [EMU_FAULT_DROP] = "drop",
+    [EMU_FAULT_CRC] = "crc",
+    [EMU_FAULT_TRUNC] = "trunc",
+    [EMU_FAULT_DELAY] = "delay",
+};
+
+static int
+emu_faults_show (struct seq_file *m, void *v)
+{
+    struct cfa779_emu *emu = m->private;
+    int i;
+
+    mutex_lock (&emu->lock);
+    for (i = 0; i < EMU_NUM_FAULTS; i++)
+        seq_printf (m, "%s %lu\n", emu_fault_names[i], emu->faults[i]);
+    mutex_unlock (&emu->lock);
+    return 0;
+}
+
+static int
+emu_faults_open (struct inode *inode, struct file *file)
+{
+    return single_open (file, emu_faults_show, inode->i_private);
+}
+
+static ssize_t
+emu_faults_write (struct file *file, const char __user *buf, size_t count,
+                  loff_t *ppos)
+{
+    struct seq_file *m = file->private_data;
+    struct cfa779_emu *emu = m->private;
+
+    mutex_lock (&emu->lock);
+    memset (emu->faults, 0, sizeof (emu->faults));
+    mutex_unlock (&emu->lock);
+    return count;
+}
+
+static const struct file_operations emu_faults_fops = {
+    .owner = THIS_MODULE,
+    .open = emu_faults_open,
+    .read = seq_read,
+    .write = emu_faults_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static ssize_t
+emu_keypad_write (struct file *file, const char __user *ubuf, size_t count,
+                  loff_t *ppos)
+{
+    struct cfa779_emu *emu = file->private_data;
+    char buf[32];
+    char action[8], name[8];
+    ssize_t ret = count;
+    u8 bit;
+    int i;
+
+    if (count >= sizeof (buf))
+        return -EINVAL;
+    if (copy_from_user (buf, ubuf, count))
+        return -EFAULT;
+    buf[count] = 0;
+
+    if (sscanf (buf, "%7s %7s", action, name) != 2)
+        return -EINVAL;
+    for (i = 0; i < EMU_NUM_KEYS; i++)
+        if (!strcmp (name, emu_keys[i].name))
+            break;
+    if (i == EMU_NUM_KEYS)
+        return -EINVAL;
+    bit = 1 << (emu_keys[i].hw - 1);
+
+    mutex_lock (&emu->lock);
+    if (!strcmp (action, "press"))
+      {
+          emu->keys |= bit;
+          emu->pressed |= bit;
+      }
+    else if (!strcmp (action, "release"))
+      {
+          emu->keys &= ~bit;
+          emu->released |= bit;
+      }
+    else if (!strcmp (action, "tap"))
+      {
+          emu->pressed |= bit;
+          emu->released |= bit;
+      }
+    else
+        ret = -EINVAL;
+    mutex_unlock (&emu->lock);
+    return ret;
+}
+
+static int
+emu_keypad_open (struct inode *inode, struct file *file)
+{
+    file->private_data = inode->i_private;
+    return 0;
+}
+
+static const struct file_operations emu_keypad_fops = {
+    .owner = THIS_MODULE,
+    .open = emu_keypad_open,
+    .write = emu_keypad_write,
+};
+
+/* ------------------------------------------------------------ */
+
+static int
+emu_add (struct cfa779_emu *emu, int nr)
+{
+    struct i2c_adapter *adap = &emu->adapter;
+    int err;
+
+    mutex_init (&emu->lock);
+    memset (emu->text, 0x20, sizeof (emu->text));
+
+    adap->owner = THIS_MODULE;
+    adap->class = detect ? I2C_CLASS_HWMON : 0;
+    adap->algo = &emu_algo;
+    snprintf (adap->name, sizeof (adap->name), "cfa779 emulator %d", nr);
+    i2c_set_adapdata (adap, emu);
+
+    err = i2c_add_adapter (adap);
+    if (err)
+        return err;
+
+    if (emu_debugfs_root && !IS_ERR (emu_debugfs_root))
+      {
+          emu->debugfs = debugfs_create_dir (dev_name (&adap->dev),
+                                             emu_debugfs_root);
+          if (emu->debugfs && !IS_ERR (emu->debugfs))
+            {
+                debugfs_create_file ("screen", S_IRUGO, emu->debugfs, emu,
+                                     &emu_screen_fops);
+                debugfs_create_file ("keypad", S_IWUSR, emu->debugfs, emu,
+                                     &emu_keypad_fops);
+                debugfs_create_file ("faults", S_IWUSR | S_IRUGO,
+                                     emu->debugfs, emu, &emu_faults_fops);
+            }
+      }
+    return 0;
+}
+
+static void
+emu_del (struct cfa779_emu *emu)
+{
+    if (emu->debugfs && !IS_ERR (emu->debugfs))
+        debugfs_remove_recursive (emu->debugfs);
+    i2c_del_adapter (&emu->adapter);
+}
+
+static int __init
+cfa779_emu_init (void)
+{
+    int err = 0;
+    int i;
+
+    if (devices < 1)
+        return -EINVAL;
+    emus = kcalloc (devices, sizeof (*emus), GFP_KERNEL);
+    if (!emus)
+        return -ENOMEM;
+
+    emu_debugfs_root = debugfs_create_dir ("cfa779-emu", NULL);
+    for (i = 0; i < devices; i++)
+        if ((err = emu_add (&emus[i], i)))
+            break;
+    if (!err)
+        return 0;
+
+    while (--i >= 0)
+        emu_del (&emus[i]);
+    if (emu_debugfs_root && !IS_ERR (emu_debugfs_root))
+        debugfs_remove (emu_debugfs_root);
+    kfree (emus);
+    return err;
+}
+
+static void __exit
+cfa779_emu_exit (void)
+{
+    int i;
+
+    for (i = 0; i < devices; i++)
+        emu_del (&emus[i]);
+    if (emu_debugfs_root && !IS_ERR (emu_debugfs_root))
+        debugfs_remove (emu_debugfs_root);
+    kfree (emus);
+}
+
+module_init (cfa779_emu_init);
+module_exit (cfa779_emu_exit);
@@ -0,0 +1,117 @@
+/*
+    cfa779_trace.h - tracepoints for the CrystalFontz CFA-779 driver
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+*/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cfa779
+
+#if !defined(_CFA779_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CFA779_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/i2c.h>
+
+/* packet written to the device */
+TRACE_EVENT (cfa779_send,
+    TP_PROTO (struct i2c_client *client, u8 code, int len, const u8 *payload),
+    TP_ARGS (client, code, len, payload),
+    TP_STRUCT__entry (
+        __field (int, adapter)
+        __field (u16, addr)
+        __field (u8, code)
+        __field (u8, len)
+        __array (u8, payload, 16)
+    ),
+    TP_fast_assign (
+        __entry->adapter = client->adapter->nr;
+        __entry->addr = client->addr;
+        __entry->code = code;
+        __entry->len = len;
+        memcpy (__entry->payload, payload, len);
+    ),
+    TP_printk ("%d-%04x code=%u len=%u", __entry->adapter, __entry->addr,
+               __entry->code, __entry->len)
+);
+
+/* reply read back and what lcd_verify_reply() made of it */
+TRACE_EVENT (cfa779_reply,
+    TP_PROTO (struct i2c_client *client, u8 code, int len, int status),
+    TP_ARGS (client, code, len, status),
+    TP_STRUCT__entry (
+        __field (int, adapter)
+        __field (u16, addr)
+        __field (u8, code)
+        __field (u8, len)
+        __field (int, status)
+    ),
+    TP_fast_assign (
+        __entry->adapter = client->adapter->nr;
+        __entry->addr = client->addr;
+        __entry->code = code;
+        __entry->len = len;
+        __entry->status = status;
+    ),
+    TP_printk ("%d-%04x code=%u len=%u status=%s", __entry->adapter,
+               __entry->addr, __entry->code, __entry->len,
+               __print_symbolic (__entry->status,
+                                 { CFA779_REPLY_OK, "ok" },
+                                 { CFA779_REPLY_NONE, "none" },
+                                 { CFA779_REPLY_BADCRC, "badcrc" },
+                                 { CFA779_REPLY_BADLEN, "badlen" },
+                                 { CFA779_REPLY_ERROR, "error" }))
+);
+
+/* complete request/reply exchange */
+TRACE_EVENT (cfa779_xfer,
+    TP_PROTO (struct i2c_client *client, u8 code, int result, u32 us),
+    TP_ARGS (client, code, result, us),
+    TP_STRUCT__entry (
+        __field (int, adapter)
+        __field (u16, addr)
+        __field (u8, code)
+        __field (int, result)
+        __field (u32, us)
+    ),
+    TP_fast_assign (
+        __entry->adapter = client->adapter->nr;
+        __entry->addr = client->addr;
+        __entry->code = code;
+        __entry->result = result;
+        __entry->us = us;
+    ),
+    TP_printk ("%d-%04x code=%u result=%d rtt=%uus", __entry->adapter,
+               __entry->addr, __entry->code, __entry->result, __entry->us)
+);
+
+/* key edge reported to the input layer */
+TRACE_EVENT (cfa779_key,
+    TP_PROTO (struct i2c_client *client, unsigned int keycode, int value),
+    TP_ARGS (client, keycode, value),
+    TP_STRUCT__entry (
+        __field (int, adapter)
+        __field (u16, addr)
+        __field (unsigned int, keycode)
+        __field (int, value)
+    ),
+    TP_fast_assign (
+        __entry->adapter = client->adapter->nr;
+        __entry->addr = client->addr;
+        __entry->keycode = keycode;
+        __entry->value = value;
+    ),
+    TP_printk ("%d-%04x key=%u %s", __entry->adapter, __entry->addr,
+               __entry->keycode, __entry->value ? "pressed" : "released")
+);
+
+#endif /* _CFA779_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE cfa779_trace
+#include <trace/define_trace.h>